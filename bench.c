@@ -0,0 +1,98 @@
+/* Statistics and output of the bench command */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench.h"
+#include "report.h"
+
+double bench_wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0E-9 * ts.tv_nsec;
+}
+
+static int cmp_ticks(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Value below which fraction p of the sorted samples lie */
+static int64_t percentile(const int64_t *ticks, size_t n, double p)
+{
+    size_t i = (size_t) (p * n);
+    return ticks[i < n ? i : n - 1];
+}
+
+void bench_summarize(bench_result_t *r,
+                     int64_t *ticks,
+                     size_t n,
+                     double seconds,
+                     int64_t total_cycles)
+{
+    r->n = n;
+    r->seconds = seconds;
+    if (!n) {
+        r->ops_per_sec = 0;
+        r->mean_cycles = 0;
+        r->mean_ns = r->p50_ns = r->p99_ns = r->p999_ns = r->max_ns = 0;
+        return;
+    }
+
+    qsort(ticks, n, sizeof(int64_t), cmp_ticks);
+    double sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += ticks[i];
+
+    double ns_per_cycle = total_cycles > 0 ? 1.0E9 * seconds / total_cycles : 0;
+    r->mean_cycles = sum / n;
+    r->mean_ns = r->mean_cycles * ns_per_cycle;
+    r->p50_ns = percentile(ticks, n, 0.5) * ns_per_cycle;
+    r->p99_ns = percentile(ticks, n, 0.99) * ns_per_cycle;
+    r->p999_ns = percentile(ticks, n, 0.999) * ns_per_cycle;
+    r->max_ns = ticks[n - 1] * ns_per_cycle;
+    /* Throughput of the timed operations alone, without any setup */
+    r->ops_per_sec = r->mean_ns > 0 ? 1.0E9 / r->mean_ns : 0;
+}
+
+void bench_report(const bench_result_t *r)
+{
+    report(1, "%s [%s]: %zu ops in %.3f s, %.0f ops/s", r->op, r->layout,
+           r->n, r->seconds, r->ops_per_sec);
+    report(1,
+           "  mean %.1f ns (%.0f cycles), p50 %.1f ns, p99 %.1f ns, "
+           "p999 %.1f ns, max %.1f ns",
+           r->mean_ns, r->mean_cycles, r->p50_ns, r->p99_ns, r->p999_ns,
+           r->max_ns);
+}
+
+bool bench_write(const bench_result_t *r, char *file, bench_format_t fmt)
+{
+    FILE *out = fopen(file, "a");
+    if (!out)
+        return false;
+
+    if (fmt == BENCH_JSON) {
+        fprintf(out,
+                "{\"op\": \"%s\", \"layout\": \"%s\", \"n\": %zu, "
+                "\"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+                "\"mean_cycles\": %.1f, \"mean_ns\": %.1f, \"p50_ns\": %.1f, "
+                "\"p99_ns\": %.1f, \"p999_ns\": %.1f, \"max_ns\": %.1f}\n",
+                r->op, r->layout, r->n, r->seconds, r->ops_per_sec,
+                r->mean_cycles, r->mean_ns, r->p50_ns, r->p99_ns, r->p999_ns,
+                r->max_ns);
+    } else {
+        if (fseek(out, 0, SEEK_END) == 0 && ftell(out) == 0)
+            fprintf(out,
+                    "op,layout,n,seconds,ops_per_sec,mean_cycles,mean_ns,"
+                    "p50_ns,p99_ns,p999_ns,max_ns\n");
+        fprintf(out, "%s,%s,%zu,%.6f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                r->op, r->layout, r->n, r->seconds, r->ops_per_sec,
+                r->mean_cycles, r->mean_ns, r->p50_ns, r->p99_ns, r->p999_ns,
+                r->max_ns);
+    }
+    return fclose(out) == 0;
+}
@@ -0,0 +1,53 @@
+#ifndef LAB0_BENCH_H
+#define LAB0_BENCH_H
+
+/*
+ * Summary statistics for the qtest bench command.
+ *
+ * Each operation is timed in CPU cycles.  Cycles are converted to
+ * nanoseconds with the cycle rate observed over the whole run, so
+ * no separate calibration is needed.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const char *op;     /* Name of the benchmarked operation */
+    const char *layout; /* Queue layout options in effect */
+    size_t n;           /* Number of timed operations */
+    double seconds;     /* Wall-clock time of the run, setup included */
+    double ops_per_sec; /* Throughput of the timed operations */
+    double mean_cycles;
+    double mean_ns, p50_ns, p99_ns, p999_ns, max_ns;
+} bench_result_t;
+
+/* Output formats for bench_write() */
+typedef enum { BENCH_CSV, BENCH_JSON } bench_format_t;
+
+/* Read the wall clock, in seconds */
+double bench_wall_time();
+
+/*
+ * Compute the statistics of a run from the cycles taken by each of its
+ * n operations, sorting the array ticks in place.  The run took seconds
+ * of wall-clock time and total_cycles cycles.
+ */
+void bench_summarize(bench_result_t *r,
+                     int64_t *ticks,
+                     size_t n,
+                     double seconds,
+                     int64_t total_cycles);
+
+/* Print a result for humans */
+void bench_report(const bench_result_t *r);
+
+/*
+ * Append a result to file as a CSV row (with a header row if the file is
+ * empty) or as one JSON object per line.
+ * Return false if the file cannot be written.
+ */
+bool bench_write(const bench_result_t *r, char *file, bench_format_t fmt);
+
+#endif /* LAB0_BENCH_H */
@@ -8,12 +8,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "perf.h"
 #include "report.h"
 
 /* Some global values */
@@ -43,12 +45,28 @@ struct RIO_ELE {
     int cnt;               /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Private mapping of a regular file, or NULL */
+    size_t map_len;        /* Size of the mapping */
+    size_t map_pos;        /* Offset of the next unread line */
     rio_ptr prev;          /* Next element in stack */
 };
 
 static rio_ptr buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
+/* Argument vector of the current command, pointing into its line */
+static char *argv_buf[RIO_BUFSIZE / 2 + 1];
+
+/*
+ * Commands and parameters are also indexed by name in open-addressed
+ * hash tables, so that lookups don't walk the sorted lists.
+ */
+#define NAME_TABLE_SIZE 256
+static cmd_ptr cmd_table[NAME_TABLE_SIZE];
+static param_ptr param_table[NAME_TABLE_SIZE];
+static int cmd_count = 0;
+static int param_count = 0;
+
 /* Maximum file descriptor */
 static int fd_max = 0;
 
@@ -73,6 +91,7 @@ static bool do_option_cmd(int argc, char *argv[]);
 static bool do_source_cmd(int argc, char *argv[]);
 static bool do_log_cmd(int argc, char *argv[]);
 static bool do_time_cmd(int argc, char *argv[]);
+static bool do_reject_cmd(int argc, char *argv[]);
 static bool do_comment_cmd(int argc, char *argv[]);
 
 static void init_in();
@@ -82,11 +101,48 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a hash of a command or parameter name */
+static size_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h & (NAME_TABLE_SIZE - 1);
+}
+
+/* Find command by name.  Return NULL if there is none */
+static cmd_ptr find_cmd(const char *name)
+{
+    for (size_t i = name_hash(name); cmd_table[i];
+         i = (i + 1) & (NAME_TABLE_SIZE - 1)) {
+        if (strcmp(cmd_table[i]->name, name) == 0)
+            return cmd_table[i];
+    }
+    return NULL;
+}
+
+/* Find parameter by name.  Return NULL if there is none */
+static param_ptr find_param(const char *name)
+{
+    for (size_t i = name_hash(name); param_table[i];
+         i = (i + 1) & (NAME_TABLE_SIZE - 1)) {
+        if (strcmp(param_table[i]->name, name) == 0)
+            return param_table[i];
+    }
+    return NULL;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    cmd_count = 0;
+    param_count = 0;
     err_cnt = 0;
     quit_flag = false;
 
@@ -98,6 +154,8 @@ void init_cmd()
             " file           | Read commands from source file");
     add_cmd("log", do_log_cmd, " file           | Copy output to file");
     add_cmd("time", do_time_cmd, " cmd arg ...    | Time command execution");
+    add_cmd("reject", do_reject_cmd,
+            " cmd arg ...    | Run command, which must fail");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", (int *) &simulation, "Start/Stop simulation mode",
               NULL);
@@ -126,6 +184,17 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->documentation = documentation;
     ele->next = next_cmd;
     *last_loc = ele;
+
+    /*
+     * Keep the table at most half full.  A newer command of the same name
+     * replaces the older one, just as it comes first in the list.
+     */
+    size_t i = name_hash(name);
+    while (cmd_table[i] && strcmp(cmd_table[i]->name, name) != 0)
+        i = (i + 1) & (NAME_TABLE_SIZE - 1);
+    if (!cmd_table[i] && ++cmd_count > NAME_TABLE_SIZE / 2)
+        report_event(MSG_FATAL, "Exceeded limit on commands");
+    cmd_table[i] = ele;
 }
 
 /* Add a new parameter */
@@ -148,52 +217,46 @@ void add_param(char *name,
     ele->setter = setter;
     ele->next = next_param;
     *last_loc = ele;
+
+    size_t i = name_hash(name);
+    while (param_table[i] && strcmp(param_table[i]->name, name) != 0)
+        i = (i + 1) & (NAME_TABLE_SIZE - 1);
+    if (!param_table[i] && ++param_count > NAME_TABLE_SIZE / 2)
+        report_event(MSG_FATAL, "Exceeded limit on parameters");
+    param_table[i] = ele;
 }
 
-/* Parse a string into a command line */
+/*
+ * Parse a string into a command line.
+ * The line is split in place by null-terminating each word, and the
+ * returned argv is reused by the next call.
+ */
 static char **parse_args(char *line, int *argcp)
 {
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
     char *src = line;
-    char *dst = buf;
     bool skipping = true;
 
     int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    while ((c = *src) != '\0') {
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
-                *dst++ = '\0';
+                *src = '\0';
                 skipping = true;
             }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
+        } else if (skipping) {
+            /* Hit start of new word */
+            if (argc < RIO_BUFSIZE / 2)
+                argv_buf[argc++] = src;
+            skipping = false;
         }
+        src++;
     }
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-
-    free_block(buf, len + 1);
+    argv_buf[argc] = NULL;
     *argcp = argc;
-    return argv;
+    return argv_buf;
 }
 
 static void record_error()
@@ -212,10 +275,8 @@ static bool interpret_cmda(int argc, char *argv[])
         return true;
 
     /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
+    cmd_ptr next_cmd = find_cmd(argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
         ok = next_cmd->operation(argc, argv);
         if (!ok)
@@ -240,12 +301,7 @@ static bool interpret_cmd(char *cmdline)
 #endif
     int argc;
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
-
-    return ok;
+    return interpret_cmda(argc, argv);
 }
 
 /* Set function to be executed as part of program exit */
@@ -280,6 +336,12 @@ static bool do_quit_cmd(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_ele));
     }
+    cmd_list = NULL;
+    param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    cmd_count = 0;
+    param_count = 0;
 
     while (buf_stack)
         pop_file();
@@ -336,6 +398,20 @@ bool get_int(char *vname, int *loc)
     return true;
 }
 
+/* Set parameter name to value.  Return false if there is no such parameter */
+bool set_option(char *name, int value)
+{
+    param_ptr plist = find_param(name);
+    if (!plist)
+        return false;
+
+    int oldval = *plist->valp;
+    *plist->valp = value;
+    if (plist->setter)
+        plist->setter(oldval);
+    return true;
+}
+
 static bool do_option_cmd(int argc, char *argv[])
 {
     if (argc == 1) {
@@ -352,7 +428,6 @@ static bool do_option_cmd(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -361,20 +436,8 @@ static bool do_option_cmd(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_ptr plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
         /* Didn't find parameter */
-        if (!found) {
+        if (!set_option(name, value)) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
@@ -420,18 +483,52 @@ static bool do_time_cmd(int argc, char *argv[])
         double elapsed = last_time - first_time;
         report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
     } else {
+        perf_counts_t start, end;
+        bool counting = perf_start();
+        if (counting)
+            perf_read(&start);
         ok = interpret_cmda(argc - 1, argv + 1);
         if (block_flag) {
             block_timing = true;
         } else {
             delta = delta_time(&last_time);
             report(1, "Delta time = %.3f", delta);
+            if (counting) {
+                perf_read(&end);
+                perf_diff(&end, &start, &end);
+                perf_report(&end);
+            }
         }
+        if (counting)
+            perf_stop();
     }
 
     return ok;
 }
 
+/*
+ * Run a command that is expected to fail, so that traces can check what
+ * gets refused.  Its failure is not counted as an error.
+ */
+static bool do_reject_cmd(int argc, char *argv[])
+{
+    if (argc <= 1) {
+        report(1, "%s needs a command", argv[0]);
+        return false;
+    }
+
+    cmd_ptr next_cmd = find_cmd(argv[1]);
+    if (!next_cmd) {
+        report(1, "Unknown command '%s'", argv[1]);
+        return false;
+    }
+    if (next_cmd->operation(argc - 1, argv + 1)) {
+        report(1, "ERROR: %s should have failed", argv[1]);
+        return false;
+    }
+    return true;
+}
+
 /* Create new buffer for named file.
  * Name == NULL for stdin.
  * Return true if successful.
@@ -449,9 +546,28 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = 0;
+    rnew->map_pos = 0;
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
+    /*
+     * Map named regular files, so lines can be handed out in place.
+     * The mapping is private and writable, since the parser splits lines.
+     * Anything else, stdin in particular, is read through the buffer.
+     */
+    struct stat st;
+    if (fname && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            rnew->map = map;
+            rnew->map_len = st.st_size;
+        }
+    }
+
     return true;
 }
 
@@ -461,6 +577,8 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -472,19 +590,58 @@ static void init_in()
     buf_stack = NULL;
 }
 
+/*
+ * Hand out the next line of a memory-mapped file, null-terminated in
+ * place of its newline.  When past the end, close the file and return NULL
+ */
+static char *map_readline()
+{
+    rio_ptr r = buf_stack;
+    if (r->map_pos == r->map_len) {
+        pop_file();
+        return NULL;
+    }
+
+    char *line = r->map + r->map_pos;
+    size_t left = r->map_len - r->map_pos;
+    char *nl = memchr(line, '\n', left);
+    if (nl) {
+        *nl = '\0';
+        r->map_pos += nl - line + 1;
+    } else {
+        /*
+         * Last line of file did not terminate with newline, and there is
+         * no room to terminate it in the mapping
+         */
+        if (left > RIO_BUFSIZE - 1)
+            left = RIO_BUFSIZE - 1;
+        memcpy(linebuf, line, left);
+        linebuf[left] = '\0';
+        line = linebuf;
+        r->map_pos = r->map_len;
+    }
+
+    if (echo) {
+        report_noreturn(1, prompt);
+        report(1, "%s", line);
+    }
+    return line;
+}
+
 /* Read command from input file.
  * When hit EOF, close that file and return NULL
  */
 static char *readline()
 {
-    int cnt;
-    char c;
-    char *lptr = linebuf;
+    size_t cnt = 0;
+    bool eol = false;
 
     if (!buf_stack)
         return NULL;
+    if (buf_stack->map)
+        return map_readline();
 
-    for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
+    while (!eol && cnt < RIO_BUFSIZE - 2) {
         if (buf_stack->cnt <= 0) {
             /* Need to read from input file */
             buf_stack->cnt = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
@@ -492,34 +649,34 @@ static char *readline()
             if (buf_stack->cnt <= 0) {
                 /* Encountered EOF */
                 pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
+                if (cnt == 0)
+                    return NULL;
+                /* Last line of file did not terminate with newline. */
+                /*  Terminate line & return it */
+                break;
             }
         }
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->cnt--;
-        if (c == '\n')
-            break;
+        /* Have text in buffer, copy it up to and including a newline */
+        size_t n = buf_stack->cnt;
+        if (n > RIO_BUFSIZE - 2 - cnt)
+            n = RIO_BUFSIZE - 2 - cnt;
+        char *nl = memchr(buf_stack->bufptr, '\n', n);
+        if (nl) {
+            n = nl - buf_stack->bufptr + 1;
+            eol = true;
+        }
+        memcpy(linebuf + cnt, buf_stack->bufptr, n);
+        buf_stack->bufptr += n;
+        buf_stack->cnt -= n;
+        cnt += n;
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+    if (!eol) {
+        /* Hit buffer limit or EOF.  Artificially terminate line */
+        linebuf[cnt++] = '\n';
     }
-    *lptr++ = '\0';
+    linebuf[cnt] = '\0';
 
     if (echo) {
         report_noreturn(1, prompt);
@@ -532,12 +689,12 @@ static char *readline()
 /* Determine if there is a complete command line in input buffer */
 static bool read_ready()
 {
-    for (int i = 0; buf_stack && i < buf_stack->cnt; i++) {
-        if (buf_stack->bufptr[i] == '\n')
-            return true;
-    }
-
-    return false;
+    if (!buf_stack)
+        return false;
+    if (buf_stack->map)
+        return buf_stack->map_pos < buf_stack->map_len;
+    return buf_stack->cnt > 0 &&
+           memchr(buf_stack->bufptr, '\n', buf_stack->cnt) != NULL;
 }
 
 static bool cmd_done()
@@ -48,6 +48,9 @@ void add_param(char *name,
                char *doccumentation,
                setter_function setter);
 
+/* Set parameter name to value.  Return false if there is no such parameter */
+bool set_option(char *name, int value);
+
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
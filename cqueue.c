@@ -0,0 +1,351 @@
+/* Lock-free queues of strings for several threads, see cqueue.h */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cqueue.h"
+#include "harness.h"
+
+/* Queue element, with its string stored inline */
+typedef struct CNODE {
+    _Atomic(struct CNODE *) next;
+    size_t len;
+    char data[];
+} cnode_t;
+
+/* Keeps fields written by different threads out of each other's line */
+#define CACHE_LINE 64
+
+struct CQUEUE {
+    /* Michael-Scott queue, whose head is a dummy element */
+    _Atomic(cnode_t *) head;
+    char pad0[CACHE_LINE - sizeof(cnode_t *)];
+    _Atomic(cnode_t *) tail;
+    char pad1[CACHE_LINE - sizeof(cnode_t *)];
+    /* Ring of a CQ_SPSC queue, using the slots [rhead, rtail) */
+    _Atomic size_t rhead;
+    char pad2[CACHE_LINE - sizeof(size_t)];
+    _Atomic size_t rtail;
+    char pad3[CACHE_LINE - sizeof(size_t)];
+    unsigned int flags;
+    cnode_t *ring[];
+};
+
+/*
+ * Hazard pointers.  Before following a pointer to an element, a thread
+ * publishes it in one of its hazard pointers and checks that the element
+ * is still in the queue.  Removed elements are retired, and only freed
+ * once no hazard pointer holds them.
+ */
+#define HP_PER_THREAD 2
+
+/* Retired elements of a thread that trigger a scan of the hazard pointers */
+#define HP_RETIRE_MAX (2 * CQ_MAX_THREADS * HP_PER_THREAD)
+
+/* Hazard pointers and retired elements of one thread */
+typedef struct {
+    _Atomic(cnode_t *) hp[HP_PER_THREAD];
+    bool used; /* Claimed by a thread, changed under hp_lock */
+    int nretired;
+    cnode_t *retired[HP_RETIRE_MAX];
+} hp_rec_t;
+
+static hp_rec_t hp_recs[CQ_MAX_THREADS];
+static pthread_mutex_t hp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t hp_once = PTHREAD_ONCE_INIT;
+static pthread_key_t hp_key;
+
+/* Index of the record of the calling thread, -1 until its first use */
+static _Thread_local int hp_slot = -1;
+
+static int cmp_ptr(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Free the elements retired in r that no hazard pointer holds */
+static void hp_scan(hp_rec_t *r)
+{
+    uintptr_t held[CQ_MAX_THREADS * HP_PER_THREAD];
+    int nheld = 0;
+    for (int i = 0; i < CQ_MAX_THREADS; i++) {
+        for (int j = 0; j < HP_PER_THREAD; j++) {
+            cnode_t *p = atomic_load(&hp_recs[i].hp[j]);
+            if (p) {
+                held[nheld++] = (uintptr_t) p;
+            }
+        }
+    }
+    qsort(held, nheld, sizeof(uintptr_t), cmp_ptr);
+
+    int kept = 0;
+    for (int i = 0; i < r->nretired; i++) {
+        uintptr_t p = (uintptr_t) r->retired[i];
+        if (bsearch(&p, held, nheld, sizeof(uintptr_t), cmp_ptr)) {
+            r->retired[kept++] = r->retired[i];
+        } else {
+            free(r->retired[i]);
+        }
+    }
+    r->nretired = kept;
+}
+
+/*
+ * Give up the record of a thread that exits.  Elements it could not free
+ * yet stay retired in the record, for cq_free() or its next owner.
+ */
+static void hp_release(void *arg)
+{
+    hp_rec_t *r = &hp_recs[(intptr_t) arg - 1];
+    for (int j = 0; j < HP_PER_THREAD; j++) {
+        atomic_store(&r->hp[j], NULL);
+    }
+    pthread_mutex_lock(&hp_lock);
+    hp_scan(r);
+    r->used = false;
+    pthread_mutex_unlock(&hp_lock);
+}
+
+static void hp_init(void)
+{
+    pthread_key_create(&hp_key, hp_release);
+}
+
+/*
+ * Return the record of the calling thread, claiming one at its first call.
+ * Return NULL if CQ_MAX_THREADS threads hold one already.
+ */
+static hp_rec_t *hp_self(void)
+{
+    if (hp_slot >= 0) {
+        return &hp_recs[hp_slot];
+    }
+
+    pthread_once(&hp_once, hp_init);
+    pthread_mutex_lock(&hp_lock);
+    for (int i = 0; i < CQ_MAX_THREADS && hp_slot < 0; i++) {
+        if (!hp_recs[i].used) {
+            hp_recs[i].used = true;
+            hp_slot = i;
+        }
+    }
+    pthread_mutex_unlock(&hp_lock);
+    if (hp_slot < 0) {
+        return NULL;
+    }
+    pthread_setspecific(hp_key, (void *) (intptr_t) (hp_slot + 1));
+    return &hp_recs[hp_slot];
+}
+
+/* Publish *src in hazard pointer hp, and return it once it is stable */
+static cnode_t *hp_protect(_Atomic(cnode_t *) *src, _Atomic(cnode_t *) *hp)
+{
+    cnode_t *p = atomic_load(src);
+    for (;;) {
+        atomic_store(hp, p);
+        cnode_t *again = atomic_load(src);
+        if (again == p) {
+            return p;
+        }
+        p = again;
+    }
+}
+
+/* Free element e once no other thread can reach it */
+static void hp_retire(hp_rec_t *r, cnode_t *e)
+{
+    r->retired[r->nretired++] = e;
+    if (r->nretired == HP_RETIRE_MAX) {
+        hp_scan(r);
+    }
+}
+
+/* Free what the records of exited threads and of the caller still retire */
+static void hp_reclaim()
+{
+    pthread_mutex_lock(&hp_lock);
+    for (int i = 0; i < CQ_MAX_THREADS; i++) {
+        if (!hp_recs[i].used || i == hp_slot) {
+            hp_scan(&hp_recs[i]);
+        }
+    }
+    pthread_mutex_unlock(&hp_lock);
+}
+
+/* Allocate an element holding a copy of s.  Return NULL if out of memory */
+static cnode_t *node_new(const char *s)
+{
+    size_t len = strlen(s);
+    cnode_t *e = malloc(sizeof(cnode_t) + len + 1);
+    if (!e) {
+        return NULL;
+    }
+    atomic_init(&e->next, NULL);
+    e->len = len;
+    memcpy(e->data, s, len + 1);
+    return e;
+}
+
+/* Copy the string of e to sp, truncated to bufsize-1 characters */
+static void copy_out(const cnode_t *e, char *sp, size_t bufsize)
+{
+    if (!sp || !bufsize) {
+        return;
+    }
+
+    size_t len = e->len < bufsize - 1 ? e->len : bufsize - 1;
+    memcpy(sp, e->data, len);
+    sp[len] = '\0';
+}
+
+cqueue_t *cq_new(unsigned int flags)
+{
+    size_t ring = (flags & CQ_SPSC) ? CQ_RING_LEN : 0;
+    cqueue_t *cq = malloc(sizeof(cqueue_t) + ring * sizeof(cnode_t *));
+    if (!cq) {
+        return NULL;
+    }
+
+    cnode_t *dummy = NULL;
+    if (!ring) {
+        dummy = node_new("");
+        if (!dummy) {
+            free(cq);
+            return NULL;
+        }
+    }
+    atomic_init(&cq->head, dummy);
+    atomic_init(&cq->tail, dummy);
+    atomic_init(&cq->rhead, 0);
+    atomic_init(&cq->rtail, 0);
+    cq->flags = flags;
+    return cq;
+}
+
+void cq_free(cqueue_t *cq)
+{
+    if (!cq) {
+        return;
+    }
+
+    if (cq->flags & CQ_SPSC) {
+        for (size_t i = cq->rhead; i != cq->rtail; i++) {
+            free(cq->ring[i % CQ_RING_LEN]);
+        }
+    } else {
+        cnode_t *e = cq->head;
+        while (e) {
+            cnode_t *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(cq);
+    hp_reclaim();
+}
+
+/* The producer owns rtail and the consumer rhead */
+static bool ring_enqueue(cqueue_t *cq, const char *s)
+{
+    size_t t = atomic_load_explicit(&cq->rtail, memory_order_relaxed);
+    if (t - atomic_load_explicit(&cq->rhead, memory_order_acquire) ==
+        CQ_RING_LEN) {
+        return false;
+    }
+
+    cnode_t *e = node_new(s);
+    if (!e) {
+        return false;
+    }
+    cq->ring[t % CQ_RING_LEN] = e;
+    atomic_store_explicit(&cq->rtail, t + 1, memory_order_release);
+    return true;
+}
+
+static bool ring_dequeue(cqueue_t *cq, char *sp, size_t bufsize)
+{
+    size_t h = atomic_load_explicit(&cq->rhead, memory_order_relaxed);
+    if (h == atomic_load_explicit(&cq->rtail, memory_order_acquire)) {
+        return false;
+    }
+
+    cnode_t *e = cq->ring[h % CQ_RING_LEN];
+    atomic_store_explicit(&cq->rhead, h + 1, memory_order_release);
+    copy_out(e, sp, bufsize);
+    free(e);
+    return true;
+}
+
+bool cq_enqueue(cqueue_t *cq, const char *s)
+{
+    if (cq->flags & CQ_SPSC) {
+        return ring_enqueue(cq, s);
+    }
+
+    hp_rec_t *r = hp_self();
+    cnode_t *e = r ? node_new(s) : NULL;
+    if (!e) {
+        return false;
+    }
+
+    for (;;) {
+        cnode_t *t = hp_protect(&cq->tail, &r->hp[0]);
+        cnode_t *next = atomic_load(&t->next);
+        if (next) {
+            /* Help the enqueue that linked next but has not moved tail */
+            atomic_compare_exchange_strong(&cq->tail, &t, next);
+            continue;
+        }
+        if (atomic_compare_exchange_strong(&t->next, &next, e)) {
+            atomic_compare_exchange_strong(&cq->tail, &t, e);
+            break;
+        }
+    }
+    atomic_store(&r->hp[0], NULL);
+    return true;
+}
+
+bool cq_dequeue(cqueue_t *cq, char *sp, size_t bufsize)
+{
+    if (cq->flags & CQ_SPSC) {
+        return ring_dequeue(cq, sp, bufsize);
+    }
+
+    hp_rec_t *r = hp_self();
+    if (!r) {
+        return false;
+    }
+
+    cnode_t *h, *next;
+    for (;;) {
+        h = hp_protect(&cq->head, &r->hp[0]);
+        next = atomic_load(&h->next);
+        atomic_store(&r->hp[1], next);
+        if (atomic_load(&cq->head) != h) {
+            continue;
+        }
+        if (!next) {
+            atomic_store(&r->hp[0], NULL);
+            return false;
+        }
+        cnode_t *t = atomic_load(&cq->tail);
+        if (h == t) {
+            atomic_compare_exchange_strong(&cq->tail, &t, next);
+            continue;
+        }
+        if (atomic_compare_exchange_strong(&cq->head, &h, next)) {
+            break;
+        }
+    }
+
+    /* next is the new dummy, whose string is now ours */
+    copy_out(next, sp, bufsize);
+    atomic_store(&r->hp[0], NULL);
+    atomic_store(&r->hp[1], NULL);
+    hp_retire(r, h);
+    return true;
+}
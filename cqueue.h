@@ -0,0 +1,57 @@
+#ifndef LAB0_CQUEUE_H
+#define LAB0_CQUEUE_H
+
+/*
+ * Concurrent queue of strings, safe to use from several threads without
+ * locks.  Like queue_t, it stores a copy of every inserted string and
+ * copies strings out on removal.
+ *
+ * The default variant is the Michael-Scott queue, taking any number of
+ * producers and consumers.  Memory of removed elements is reclaimed with
+ * hazard pointers, so it goes back to the allocator while other threads
+ * may still be reading the queue.
+ * CQ_SPSC selects a bounded ring instead, for one producer thread and one
+ * consumer thread only.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct CQUEUE cqueue_t;
+
+/* Use a ring of CQ_RING_LEN strings for one producer and one consumer */
+#define CQ_SPSC 0x1
+
+#define CQ_RING_LEN 1024
+
+/* Most threads that may use the queues at the same time */
+#define CQ_MAX_THREADS 64
+
+/*
+ * Create empty queue of the variant selected by flags.
+ * Return NULL if could not allocate space.
+ */
+cqueue_t *cq_new(unsigned int flags);
+
+/*
+ * Free all storage used by queue, which no thread may be using any more.
+ * No effect if cq is NULL
+ */
+void cq_free(cqueue_t *cq);
+
+/*
+ * Attempt to insert a copy of string s at tail of queue.
+ * Return false if could not allocate space, or if the ring of a CQ_SPSC
+ * queue is full.
+ */
+bool cq_enqueue(cqueue_t *cq, const char *s);
+
+/*
+ * Attempt to remove the element at head of queue.
+ * Return false if queue is empty.
+ * If sp is non-NULL, copy the removed string to *sp as q_remove_head()
+ * does.
+ */
+bool cq_dequeue(cqueue_t *cq, char *sp, size_t bufsize);
+
+#endif /* LAB0_CQUEUE_H */
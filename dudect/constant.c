@@ -1,5 +1,4 @@
 #include "constant.h"
-#include <assert.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,10 +6,11 @@
 #include <string.h>
 #include <unistd.h>
 #include "cpucycles.h"
+#include "perf.h"
 #include "queue.h"
 #include "random.h"
 
-#define NR_MEASURE 150
+#define NR_MEASURE 500
 /* Allow random number range from 0 to 65535 */
 const size_t chunk_size = 16;
 /* Number of measurements per test */
@@ -22,12 +22,26 @@ const int drop_size = 20;
 static queue_t *q = NULL;
 static char random_string[NR_MEASURE][8];
 static int random_string_iter = 0;
-enum { test_insert_tail, test_size };
+/* Scratch queue of the fixed class, see prefill() */
+static queue_t *scratch = NULL;
+/* Elements handled by each bulk operation */
+static int dut_count = 1;
+/* Flags given to q_new_flags() for every queue of the test */
+static unsigned int dut_flags = 0;
+/* Argument of the measured operation */
+static char *dut_str = NULL;
+static char removed[8];
+/* Queue appended by the concat operation */
+static queue_t *other = NULL;
 
 /* Implement the necessary queue interface to simulation */
-void init_dut(void)
+void init_dut(int count, unsigned int flags)
 {
     q = NULL;
+    scratch = NULL;
+    other = NULL;
+    dut_count = count;
+    dut_flags = flags;
 }
 
 char *get_random_string(void)
@@ -52,34 +66,159 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
     }
 }
 
+/*
+ * Fill the queue under test with base elements plus the number given by
+ * input, which is zero for the fixed class.  The fixed class then does
+ * the same work on a scratch queue instead, so that both classes leave
+ * the allocator and the caches alike before the measurement.
+ */
+static void prefill(uint8_t *input, int base)
+{
+    int n = *(uint16_t *) input % 10000;
+    char *s = get_random_string();
+    dut_str = get_random_string();
+    if (n) {
+        dut_new();
+        dut_insert_head(s, base + n);
+        return;
+    }
+
+    /* Like the other class, create the queue and then insert elements */
+    scratch = q_new_flags(dut_flags);
+    for (int m = *(uint16_t *) (input + 2) % 10000; m > 1; m--)
+        q_insert_head(scratch, s);
+    dut_new();
+    dut_insert_head(s, base);
+    q_insert_head(scratch, s);
+}
+
+/* Keep the queue from being empty, so both classes take the same path */
+static void setup_fill(uint8_t *input)
+{
+    prefill(input, 1);
+}
+
+/* Leave enough elements for the removals in both classes */
+static void setup_fill_removable(uint8_t *input)
+{
+    prefill(input, dut_count);
+}
+
+/* Also build the queue to append, of the same length in both classes */
+static void setup_fill_concat(uint8_t *input)
+{
+    other = q_new_flags(dut_flags);
+    q_insert_head(other, get_random_string());
+    setup_fill(input);
+}
+
+static void teardown_free(void)
+{
+    dut_free();
+    q_free(scratch);
+    scratch = NULL;
+    q_free(other);
+    other = NULL;
+}
+
+static void run_insert_head(void)
+{
+    dut_insert_head(dut_str, 1);
+}
+
+static void run_insert_tail(void)
+{
+    dut_insert_tail(dut_str, 1);
+}
+
+static void run_remove_head(void)
+{
+    q_remove_head(q, removed, sizeof(removed));
+}
+
+static void run_size(void)
+{
+    dut_size(1);
+}
+
+static void run_reverse(void)
+{
+    q_reverse(q);
+}
+
+static void run_concat(void)
+{
+    q_concat(q, other);
+}
+
+static void run_insert_head_bulk(void)
+{
+    q_insert_head_bulk(q, &dut_str, 1, dut_count);
+}
+
+static void run_insert_tail_bulk(void)
+{
+    q_insert_tail_bulk(q, &dut_str, 1, dut_count);
+}
+
+static void run_remove_head_bulk(void)
+{
+    q_remove_head_bulk(q, removed, sizeof(removed), dut_count);
+}
+
+static const dut_op_t dut_ops[] = {
+    {"insert_head", DUT_CONSTANT, 0, setup_fill, run_insert_head,
+     teardown_free},
+    {"insert_tail", DUT_CONSTANT, 0, setup_fill, run_insert_tail,
+     teardown_free},
+    {"remove_head", DUT_CONSTANT, 0, setup_fill_removable, run_remove_head,
+     teardown_free},
+    {"size", DUT_CONSTANT, 0, setup_fill, run_size, teardown_free},
+    {"reverse", DUT_LINEAR, Q_DLIST, setup_fill, run_reverse, teardown_free},
+    {"concat", DUT_CONSTANT, 0, setup_fill_concat, run_concat, teardown_free},
+    {"insert_head_bulk", DUT_CONSTANT, 0, setup_fill, run_insert_head_bulk,
+     teardown_free},
+    {"insert_tail_bulk", DUT_CONSTANT, 0, setup_fill, run_insert_tail_bulk,
+     teardown_free},
+    {"remove_head_bulk", DUT_CONSTANT, 0, setup_fill_removable,
+     run_remove_head_bulk, teardown_free},
+};
+
+const dut_op_t *dut_find(char *name)
+{
+    for (size_t i = 0; i < sizeof(dut_ops) / sizeof(dut_ops[0]); i++) {
+        if (strcmp(dut_ops[i].name, name) == 0)
+            return &dut_ops[i];
+    }
+    return NULL;
+}
+
+dut_class_t dut_expect(const dut_op_t *op, unsigned int flags)
+{
+    /* Q_DLIST is ignored together with Q_UNROLLED, see queue.h */
+    if (flags & Q_UNROLLED)
+        flags &= ~Q_DLIST;
+    return (flags & op->constant_flags) ? DUT_CONSTANT : op->expect;
+}
+
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
+             perf_counts_t *events,
              uint8_t *input_data,
-             int mode)
-{
-    assert(mode == test_insert_tail || mode == test_size);
-    if (mode == test_insert_tail) {
-        for (size_t i = drop_size; i < number_measurements - drop_size; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
-    } else {
-        for (size_t i = drop_size; i < number_measurements - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+             const dut_op_t *op)
+{
+    perf_counts_t start, end;
+    for (size_t i = drop_size; i < number_measurements - drop_size; i++) {
+        op->setup(input_data + i * chunk_size);
+        if (events)
+            perf_read(&start);
+        before_ticks[i] = cpucycles_start();
+        op->run();
+        after_ticks[i] = cpucycles_end();
+        if (events) {
+            perf_read(&end);
+            perf_diff(&events[i], &start, &end);
         }
+        op->teardown();
     }
 }
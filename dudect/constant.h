@@ -2,7 +2,8 @@
 #define DUDECT_CONSTANT_H
 
 #include <stdint.h>
-#define dut_new() ((void) (q = q_new()))
+#include "../perf.h"
+#define dut_new() ((void) (q = q_new_flags(dut_flags)))
 
 #define dut_size(n)                                \
     do {                                           \
@@ -26,11 +27,41 @@
 
 #define dut_free() ((void) (q_free(q)))
 
-void init_dut();
+/* How the time of an operation is expected to grow with the queue length */
+typedef enum { DUT_CONSTANT, DUT_LINEAR } dut_class_t;
+
+/* An operation whose timing can be checked */
+typedef struct {
+    char *name;
+    dut_class_t expect;
+    /* Backend flags under which a linear operation takes constant time */
+    unsigned int constant_flags;
+    /* Build the queue for one measurement from its input chunk */
+    void (*setup)(uint8_t *input);
+    /* The measured operation */
+    void (*run)(void);
+    /* Release what setup built */
+    void (*teardown)(void);
+} dut_op_t;
+
+/* Find operation name in the table, or return NULL */
+const dut_op_t *dut_find(char *name);
+
+/* How the time of op grows in queues created with flags */
+dut_class_t dut_expect(const dut_op_t *op, unsigned int flags);
+
+/*
+ * Start a test whose bulk operations handle count elements each, on
+ * queues created with flags
+ */
+void init_dut(int count, unsigned int flags);
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
+
+/* Time op on each input, counting hardware events too unless events is NULL */
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
+             perf_counts_t *events,
              uint8_t *input_data,
-             int mode);
+             const dut_op_t *op);
 
 #endif
@@ -1,12 +1,85 @@
+#ifndef DUDECT_CPUCYCLES_H
+#define DUDECT_CPUCYCLES_H
+
 #include <stdint.h>
+
+/*
+ * Read the cycle counter.  cpucycles_start() and cpucycles_end() bracket
+ * a measured operation: they keep its instructions from moving across the
+ * counter reads, which plain cpucycles() does not.
+ *
+ * On aarch64 the counter is the virtual timer, which ticks at a fixed
+ * frequency independent of the CPU clock.  Elsewhere it falls back to a
+ * monotonic clock in nanoseconds.
+ */
+
+#if defined(__i386__) || defined(__x86_64__)
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
 static inline int64_t cpucycles(void)
 {
-#if defined(__i386__) || defined(__x86_64__)
     unsigned int hi, lo;
     __asm__ volatile("rdtsc\n\t" : "=a"(lo), "=d"(hi));
     return ((int64_t) lo) | (((int64_t) hi) << 32);
+}
+
+static inline int64_t cpucycles_start(void)
+{
+    unsigned int hi, lo;
+    /* Wait for earlier instructions to complete before reading */
+    __asm__ volatile("lfence\n\trdtsc\n\t" : "=a"(lo), "=d"(hi)::"memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+}
+
+static inline int64_t cpucycles_end(void)
+{
+    unsigned int hi, lo, aux;
+    /* rdtscp waits for the measured instructions, lfence holds back later
+     * ones */
+    __asm__ volatile("rdtscp\n\tlfence\n\t"
+                     : "=a"(lo), "=d"(hi), "=c"(aux)::"memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+}
+#elif defined(__aarch64__)
+static inline int64_t cpucycles(void)
+{
+    uint64_t val;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(val));
+    return (int64_t) val;
+}
+
+static inline int64_t cpucycles_start(void)
+{
+    uint64_t val;
+    __asm__ volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(val)::"memory");
+    return (int64_t) val;
+}
+
+static inline int64_t cpucycles_end(void)
+{
+    uint64_t val;
+    __asm__ volatile("isb\n\tmrs %0, cntvct_el0\n\tisb"
+                     : "=r"(val)::"memory");
+    return (int64_t) val;
+}
 #else
-#error Unsupported Architecture
-#endif
+#include <time.h>
+
+static inline int64_t cpucycles(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int64_t cpucycles_start(void)
+{
+    return cpucycles();
 }
+
+static inline int64_t cpucycles_end(void)
+{
+    return cpucycles();
+}
+#endif
+
+#endif /* DUDECT_CPUCYCLES_H */
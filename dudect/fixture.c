@@ -25,16 +25,27 @@
  *  - as long as any of the different test fails, the code will be deemed
  *    variable time.
  *
+ *  - a try ends as soon as its outcome is clear: when some test exceeds
+ *    twice t_threshold_moderate, or when the largest t value, scaled up to
+ *    enough_measurements, stays well below t_threshold_moderate.
+ *
+ *  - the fixed class does the setup work of the random class on a scratch
+ *    queue (see constant.c), so the classes differ only in the queue that
+ *    is measured.
+ *
  */
 
+#define _GNU_SOURCE
 #include "fixture.h"
 #include <assert.h>
 #include <math.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "../console.h"
+#include "../perf.h"
 #include "../random.h"
 #include "constant.h"
 #include "ttest.h"
@@ -42,56 +53,151 @@
 #define enough_measurements 10000
 #define test_tries 10
 
+/* Fewest measurements a test needs before it takes part in the decision */
+#define min_measurements 2500
+
+/* Cropped tests, one per percentile */
+#define number_percentiles 100
+
+/* Uncropped test, cropped tests and second-order test */
+#define number_tests (1 + number_percentiles + 1)
+
 extern const int drop_size;
 extern const size_t chunk_size;
 extern const size_t number_measurements;
-static t_ctx *t;
 
 /* threshold values for Welch's t-test */
-#define t_threshold_bananas                                                  \
-    500                         /* Test failed with overwhelming probability \
-                                 */
 #define t_threshold_moderate 10 /* Test failed */
 
+/* Outcome of a batch of measurements */
+enum { verdict_undecided, verdict_pass, verdict_fail };
+
+/* Buffers of a test run, allocated once and reused by every batch */
+typedef struct {
+    int64_t *before_ticks;
+    int64_t *after_ticks;
+    int64_t *exec_times;
+    int64_t *sorted_times;
+    uint8_t *classes;
+    uint8_t *input_data;
+    int64_t percentiles[number_percentiles];
+    t_ctx t[number_tests];
+    /* Hardware events of each measurement, and their sums per class */
+    bool counting;
+    perf_counts_t *events;
+    double event_sum[2][PERF_NEVENTS];
+    double event_n[2];
+} dudect_ctx_t;
+
 static void __attribute__((noreturn)) die(void)
 {
     exit(111);
 }
 
-static void differentiate(int64_t *exec_times,
-                          int64_t *before_ticks,
-                          int64_t *after_ticks)
+static void differentiate(dudect_ctx_t *ctx)
+{
+    for (size_t i = 0; i < number_measurements; i++) {
+        ctx->exec_times[i] = ctx->after_ticks[i] - ctx->before_ticks[i];
+    }
+}
+
+static int cmp_times(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Set the cropping thresholds from the first batch of a try.
+ * Percentile i keeps the fastest 1 - 0.5^(10 (i + 1) / 100) of the
+ * measurements, so the thresholds are denser near the fast end.
+ */
+static void prepare_percentiles(dudect_ctx_t *ctx)
 {
+    size_t n = 0;
     for (size_t i = 0; i < number_measurements; i++) {
-        exec_times[i] = after_ticks[i] - before_ticks[i];
+        if (ctx->exec_times[i] > 0)
+            ctx->sorted_times[n++] = ctx->exec_times[i];
+    }
+    if (!n)
+        return;
+
+    qsort(ctx->sorted_times, n, sizeof(int64_t), cmp_times);
+    for (size_t i = 0; i < number_percentiles; i++) {
+        double which = 1 - pow(0.5, 10 * (double) (i + 1) / number_percentiles);
+        size_t k = (size_t) (which * n);
+        ctx->percentiles[i] = ctx->sorted_times[k < n ? k : n - 1];
     }
 }
 
-static void update_statistics(int64_t *exec_times, uint8_t *classes)
+static void update_statistics(dudect_ctx_t *ctx)
 {
+    t_ctx *second_order = &ctx->t[number_tests - 1];
     for (size_t i = 0; i < number_measurements; i++) {
-        int64_t difference = exec_times[i];
+        int64_t difference = ctx->exec_times[i];
         /* Cpu cycle counter overflowed or dropped measurement */
         if (difference <= 0) {
             continue;
         }
+        uint8_t class = ctx->classes[i];
+
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&ctx->t[0], difference, class);
+
+        if (ctx->counting) {
+            for (int e = 0; e < PERF_NEVENTS; e++)
+                ctx->event_sum[class][e] += ctx->events[i].count[e];
+            ctx->event_n[class]++;
+        }
+
+        /* do a t-test on cropped execution times, for several cropping
+         * thresholds.
+         */
+        for (size_t crop = 0; crop < number_percentiles; crop++) {
+            if (difference < ctx->percentiles[crop])
+                t_push(&ctx->t[crop + 1], difference, class);
+        }
+
+        /* do a second-order test once the means have settled */
+        if (ctx->t[0].n[0] > min_measurements / 2) {
+            double centered = difference - ctx->t[0].mean[class];
+            t_push(second_order, centered * centered, class);
+        }
     }
 }
 
-static bool report(void)
+/* Return the test with the largest t value among those with enough data */
+static t_ctx *max_test(dudect_ctx_t *ctx)
 {
+    t_ctx *worst = &ctx->t[0];
+    double max_t = 0;
+    for (size_t i = 0; i < number_tests; i++) {
+        t_ctx *t = &ctx->t[i];
+        if (t->n[0] + t->n[1] < min_measurements)
+            continue;
+        double x = fabs(t_compute(t));
+        if (x > max_t) {
+            max_t = x;
+            worst = t;
+        }
+    }
+    return worst;
+}
+
+static int report(dudect_ctx_t *ctx)
+{
+    t_ctx *t = max_test(ctx);
     double max_t = fabs(t_compute(t));
     double number_traces_max_t = t->n[0] + t->n[1];
     double max_tau = max_t / sqrt(number_traces_max_t);
+    double measured = ctx->t[0].n[0] + ctx->t[0].n[1];
 
     printf("\033[A\033[2K");
-    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < enough_measurements) {
+    printf("meas: %7.2lf M, ", (measured / 1e6));
+    if (measured < min_measurements) {
         printf("not enough measurements (%.0f still to go).\n",
-               enough_measurements - number_traces_max_t);
-        return false;
+               min_measurements - measured);
+        return verdict_undecided;
     }
 
     /*
@@ -108,88 +214,134 @@ static bool report(void)
     printf("max t: %+7.2f, max tau: %.2e, (5/tau)^2: %.2e.\n", max_t, max_tau,
            (double) (5 * 5) / (double) (max_tau * max_tau));
 
-    if (max_t > t_threshold_bananas) {
-        return false;
-    } else if (max_t > t_threshold_moderate) {
-        return false;
-    } else { /* max_t < t_threshold_moderate */
-        return true;
-    }
+    /* A leak grows t with the square root of the number of measurements */
+    if (max_tau * sqrt(enough_measurements) < t_threshold_moderate / 2)
+        return verdict_pass;
+    if (max_t > 2 * t_threshold_moderate)
+        return verdict_fail;
+    if (measured < enough_measurements)
+        return verdict_undecided;
+    return max_t > t_threshold_moderate ? verdict_fail : verdict_pass;
 }
 
-static bool doit(int mode)
+static int doit(dudect_ctx_t *ctx, const dut_op_t *op, bool first)
 {
-    int64_t *before_ticks = calloc(number_measurements + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(number_measurements + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(number_measurements, sizeof(int64_t));
-    uint8_t *classes = calloc(number_measurements, sizeof(uint8_t));
-    uint8_t *input_data =
-        calloc(number_measurements * chunk_size, sizeof(uint8_t));
-
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
-        die();
-    }
+    prepare_inputs(ctx->input_data, ctx->classes);
 
-    prepare_inputs(input_data, classes);
+    measure(ctx->before_ticks, ctx->after_ticks,
+            ctx->counting ? ctx->events : NULL, ctx->input_data, op);
+    differentiate(ctx);
+    if (first)
+        prepare_percentiles(ctx);
+    update_statistics(ctx);
+    return report(ctx);
+}
 
-    measure(before_ticks, after_ticks, input_data, mode);
-    differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    bool ret = report();
+static dudect_ctx_t *ctx_new(void)
+{
+    dudect_ctx_t *ctx = calloc(1, sizeof(dudect_ctx_t));
+    if (!ctx)
+        die();
+    /* Dropped measurements are never written and stay zero */
+    ctx->before_ticks = calloc(number_measurements + 1, sizeof(int64_t));
+    ctx->after_ticks = calloc(number_measurements + 1, sizeof(int64_t));
+    ctx->exec_times = calloc(number_measurements, sizeof(int64_t));
+    ctx->sorted_times = calloc(number_measurements, sizeof(int64_t));
+    ctx->classes = calloc(number_measurements, sizeof(uint8_t));
+    ctx->input_data = calloc(number_measurements * chunk_size, sizeof(uint8_t));
+    ctx->events = calloc(number_measurements, sizeof(perf_counts_t));
 
-    free(before_ticks);
-    free(after_ticks);
-    free(exec_times);
-    free(classes);
-    free(input_data);
+    if (!ctx->before_ticks || !ctx->after_ticks || !ctx->exec_times ||
+        !ctx->sorted_times || !ctx->classes || !ctx->input_data ||
+        !ctx->events) {
+        die();
+    }
+    return ctx;
+}
 
-    return ret;
+static void ctx_free(dudect_ctx_t *ctx)
+{
+    free(ctx->before_ticks);
+    free(ctx->after_ticks);
+    free(ctx->exec_times);
+    free(ctx->sorted_times);
+    free(ctx->classes);
+    free(ctx->input_data);
+    free(ctx->events);
+    free(ctx);
 }
 
-static void init_once(void)
+static void init_once(dudect_ctx_t *ctx, int count, unsigned int flags)
 {
-    init_dut();
-    t_init(t);
+    init_dut(count, flags);
+    for (size_t i = 0; i < number_tests; i++)
+        t_init(&ctx->t[i]);
+    memset(ctx->percentiles, 0, sizeof(ctx->percentiles));
+    memset(ctx->event_sum, 0, sizeof(ctx->event_sum));
+    memset(ctx->event_n, 0, sizeof(ctx->event_n));
 }
 
-bool is_insert_tail_const(void)
+/* Print the mean hardware events per operation of each class */
+static void report_events(dudect_ctx_t *ctx)
 {
-    bool result = false;
-    t = malloc(sizeof(t_ctx));
+    if (!ctx->event_n[0] || !ctx->event_n[1])
+        return;
 
-    for (int cnt = 0; cnt < test_tries; ++cnt) {
-        printf("Testing insert_tail...(%d/%d)\n\n", cnt, test_tries);
-        init_once();
-        for (int i = 0;
-             i <
-             enough_measurements / (number_measurements - drop_size * 2) + 1;
-             ++i)
-            result = doit(0);
-        printf("\033[A\033[2K\033[A\033[2K");
-        if (result == true)
-            break;
+    printf("Mean events (fixed / random class):");
+    for (int e = 0; e < PERF_NEVENTS; e++) {
+        printf(" %s %.1f / %.1f", perf_event_names[e],
+               ctx->event_sum[0][e] / ctx->event_n[0],
+               ctx->event_sum[1][e] / ctx->event_n[1]);
     }
-    free(t);
-    return result;
+    printf("\n");
+}
+
+/*
+ * Keep the measuring thread on the CPU it is running on, so that the
+ * cycle counter is not read on different cores.
+ * Return false, leaving the affinity alone, if it cannot be changed.
+ */
+static bool pin_cpu(cpu_set_t *saved)
+{
+    int cpu = sched_getcpu();
+    if (cpu < 0 || sched_getaffinity(0, sizeof(*saved), saved) != 0)
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
 }
 
-bool is_size_const(void)
+bool dut_check(const dut_op_t *op, int count, unsigned int flags)
 {
     bool result = false;
-    t = malloc(sizeof(t_ctx));
+    /* A linear operation passes when its timing leaks the queue length */
+    int expected = dut_expect(op, flags) == DUT_CONSTANT ? verdict_pass
+                                                         : verdict_fail;
+    dudect_ctx_t *ctx = ctx_new();
+    cpu_set_t saved;
+    bool pinned = pin_cpu(&saved);
+    ctx->counting = perf_start();
+
     for (int cnt = 0; cnt < test_tries; ++cnt) {
-        printf("Testing size...(%d/%d)\n\n", cnt, test_tries);
-        init_once();
-        for (int i = 0;
-             i <
-             enough_measurements / (number_measurements - drop_size * 2) + 1;
-             ++i)
-            result = doit(1);
+        printf("Testing %s...(%d/%d)\n\n", op->name, cnt, test_tries);
+        init_once(ctx, count, flags);
+        int verdict = verdict_undecided;
+        for (bool first = true; verdict == verdict_undecided; first = false)
+            verdict = doit(ctx, op, first);
         printf("\033[A\033[2K\033[A\033[2K");
+        result = verdict == expected;
         if (result == true)
             break;
     }
-    free(t);
+
+    if (ctx->counting) {
+        report_events(ctx);
+        perf_stop();
+    }
+    if (pinned)
+        sched_setaffinity(0, sizeof(saved), &saved);
+    ctx_free(ctx);
     return result;
 }
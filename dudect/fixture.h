@@ -4,8 +4,11 @@
 #include <stdbool.h>
 #include "constant.h"
 
-/* Interface to test if function is constant */
-bool is_insert_tail_const(void);
-bool is_size_const(void);
+/*
+ * Test how the time of operation op depends on the length of queues created
+ * with flags, with bulk operations handling count elements each.
+ * Return true if it grows as dut_expect() says.
+ */
+bool dut_check(const dut_op_t *op, int count, unsigned int flags);
 
 #endif
@@ -1,12 +1,15 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -18,6 +21,9 @@
 /* Value at start of every allocated block */
 #define MAGICHEADER 0xdeadbeef
 
+/* Value at start of allocated blocks skipped by sampling */
+#define MAGICUNCHECKED 0xfeedbeef
+
 /* Value when deallocate block */
 #define MAGICFREE 0xffffffff
 
@@ -30,23 +36,37 @@
 /* Data structures used by our code */
 
 /*
- * Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
+ * Header in front of every allocated block.
+ * Live blocks are tracked in an open-addressing hash set keyed by header
+ * address, so checking and forgetting a block on free takes O(1).
  */
 typedef struct BELE {
-    struct BELE *next, *prev;
     size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    uint32_t magic_header; /* Marker to see if block seems legitimate */
+    int32_t owner;         /* Set by set_alloc_owner(), -1 if none */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
-static block_ele_t *allocated = NULL;
+/* Initial capacity of the hash set is 1 << LIVE_MIN_BITS slots */
+#define LIVE_MIN_BITS 10
+
+static block_ele_t **live_set = NULL; /* Linear probing, NULL if free */
+static int live_bits = 0;
 static size_t allocated_count = 0;
 
+/* Number of allocated blocks of each owner below owner_cap */
+static size_t *owner_counts = NULL;
+static int owner_cap = 0;
+static int current_owner = -1;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Check footers and poison memory of one in this many allocations */
+int check_interval = 1;
+static int check_countdown = 0;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
@@ -54,6 +74,10 @@ static char *error_message = "";
 
 static int time_limit = 1;
 
+/* Serializes test_malloc() and test_free() in threaded mode */
+static bool threaded_mode = false;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Data for managing exceptions
  */
@@ -68,8 +92,101 @@ static bool time_limited = false;
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    if (!fail_probability)
+        return false;
+    return (int) random_below(100) < fail_probability;
+}
+
+/* Home slot of block b in the hash set */
+static size_t live_slot(const block_ele_t *b)
+{
+    /* Fibonacci hashing, taking the well-mixed high bits of the product */
+    uint64_t h = (uint64_t) (uintptr_t) b * 0x9e3779b97f4a7c15ULL;
+    return (size_t) (h >> (64 - live_bits));
+}
+
+/* Store b in the first free slot from its home slot on */
+static void live_place(block_ele_t *b)
+{
+    size_t mask = ((size_t) 1 << live_bits) - 1;
+    size_t i = live_slot(b);
+    while (live_set[i])
+        i = (i + 1) & mask;
+    live_set[i] = b;
+}
+
+/*
+ * Add block b to the set of live blocks, growing the set to keep it at
+ * most 3/4 full.  Return false if could not allocate space.
+ */
+static bool live_add(block_ele_t *b)
+{
+    size_t capacity = live_set ? (size_t) 1 << live_bits : 0;
+    if (4 * (allocated_count + 1) > 3 * capacity) {
+        block_ele_t **old = live_set;
+        int bits = old ? live_bits + 1 : LIVE_MIN_BITS;
+        block_ele_t **set = calloc((size_t) 1 << bits, sizeof(*set));
+        if (!set)
+            return false;
+
+        live_set = set;
+        live_bits = bits;
+        for (size_t i = 0; i < capacity; i++) {
+            if (old[i])
+                live_place(old[i]);
+        }
+        free(old);
+    }
+    live_place(b);
+    return true;
+}
+
+/* Find slot holding block b.  Return false if b is not a live block */
+static bool live_find(const block_ele_t *b, size_t *slot)
+{
+    if (!live_set)
+        return false;
+
+    size_t mask = ((size_t) 1 << live_bits) - 1;
+    size_t i = live_slot(b);
+    while (live_set[i] != b) {
+        if (!live_set[i])
+            return false;
+        i = (i + 1) & mask;
+    }
+    *slot = i;
+    return true;
+}
+
+/*
+ * Remove the block in slot i from the set.
+ * Later entries of the probe sequence are shifted back into the hole,
+ * so that lookups never need tombstones.
+ */
+static void live_remove(size_t i)
+{
+    size_t mask = ((size_t) 1 << live_bits) - 1;
+    for (size_t j = (i + 1) & mask; live_set[j]; j = (j + 1) & mask) {
+        size_t home = live_slot(live_set[j]);
+        /* Entry j may fill the hole unless its home lies in (i, j] */
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            live_set[i] = live_set[j];
+            i = j;
+        }
+    }
+    live_set[i] = NULL;
+}
+
+/* Should this allocation get footer checks and poisoning? */
+static bool check_allocation()
+{
+    if (check_interval <= 1)
+        return true;
+    if (--check_countdown > 0)
+        return false;
+    check_countdown = check_interval;
+    return true;
 }
 
 /*
@@ -84,15 +201,10 @@ static block_ele_t *find_header(void *p)
     }
 
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
-    if (cautious_mode) {
+    if (cautious_mode && b->magic_header != MAGICUNCHECKED) {
         /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        size_t slot;
+        if (!live_find(b, &slot)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -100,7 +212,7 @@ static block_ele_t *find_header(void *p)
         }
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (b->magic_header != MAGICHEADER && b->magic_header != MAGICUNCHECKED) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
@@ -122,7 +234,7 @@ static size_t *find_footer(block_ele_t *b)
 /*
  * Implementation of application functions
  */
-void *test_malloc(size_t size)
+static void *alloc_block(size_t size)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
@@ -141,26 +253,42 @@ void *test_malloc(size_t size)
         error_occurred = true;
     }
 
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
+    new_block->owner = current_owner;
     void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
+    if (check_allocation()) {
+        /* Only checked blocks are tracked in the set of live blocks */
+        if (!live_add(new_block)) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+            free(new_block);
+            return NULL;
+        }
+        new_block->magic_header = MAGICHEADER;
+        *find_footer(new_block) = MAGICFOOTER;
+        memset(p, FILLCHAR, size);
+    } else {
+        new_block->magic_header = MAGICUNCHECKED;
+    }
+    if (current_owner >= 0)
+        owner_counts[current_owner]++;
     allocated_count++;
 
     return p;
 }
 
+void *test_malloc(size_t size)
+{
+    if (!threaded_mode)
+        return alloc_block(size);
+
+    pthread_mutex_lock(&alloc_lock);
+    void *p = alloc_block(size);
+    pthread_mutex_unlock(&alloc_lock);
+    return p;
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
@@ -173,7 +301,7 @@ void *test_calloc(size_t nelem, size_t elsize)
     return ptr;
 }
 
-void test_free(void *p)
+static void release_block(void *p)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to free disallowed");
@@ -184,32 +312,43 @@ void test_free(void *p)
         return;
 
     block_ele_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+    if (b->magic_header == MAGICHEADER) {
+        size_t footer = *find_footer(b);
+        if (footer != MAGICFOOTER) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p when "
+                         "attempting to free it",
+                         p);
+            error_occurred = true;
+        }
+        *find_footer(b) = MAGICFREE;
+        memset(p, FILLCHAR, b->payload_size);
+
+        /* Forget the block */
+        size_t slot;
+        if (live_find(b, &slot))
+            live_remove(slot);
     }
     b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_ele_t *bn = b->next;
-    block_ele_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    if (b->owner >= 0 && b->owner < owner_cap)
+        owner_counts[b->owner]--;
 
     free(b);
     allocated_count--;
 }
 
+void test_free(void *p)
+{
+    if (!threaded_mode) {
+        release_block(p);
+        return;
+    }
+
+    pthread_mutex_lock(&alloc_lock);
+    release_block(p);
+    pthread_mutex_unlock(&alloc_lock);
+}
+
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
@@ -226,6 +365,29 @@ size_t allocation_check()
     return allocated_count;
 }
 
+void set_alloc_owner(int owner)
+{
+    if (owner >= owner_cap) {
+        int cap = owner_cap ? owner_cap : 16;
+        while (cap <= owner)
+            cap *= 2;
+        size_t *counts = realloc(owner_counts, cap * sizeof(size_t));
+        if (!counts) {
+            report_event(MSG_FATAL, "Couldn't allocate space for owners");
+            return;
+        }
+        memset(counts + owner_cap, 0, (cap - owner_cap) * sizeof(size_t));
+        owner_counts = counts;
+        owner_cap = cap;
+    }
+    current_owner = owner;
+}
+
+size_t allocation_check_owner(int owner)
+{
+    return owner < owner_cap ? owner_counts[owner] : 0;
+}
+
 /*
  * Implementation of functions for testing
  */
@@ -248,6 +410,15 @@ void set_noallocate_mode(bool noallocate)
     noallocate_mode = noallocate;
 }
 
+/*
+ * Set/unset threaded mode.
+ * In this mode, calls to malloc and free may come from several threads.
+ */
+void set_threaded_mode(bool threaded)
+{
+    threaded_mode = threaded;
+}
+
 /*
  * Return whether any errors have occurred since last time set error limit
  */
@@ -8,7 +8,8 @@
 /*
  * This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
- * allow checking for common allocation errors.
+ * allow checking for common allocation errors.  In threaded mode, these
+ * may be called from several threads at once.
  */
 
 void *test_malloc(size_t size);
@@ -22,9 +23,25 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/*
+ * Tag the blocks allocated from now on with owner, a small number >= 0.
+ * The harness counts the allocated blocks of every owner.
+ */
+void set_alloc_owner(int owner);
+
+/* Report number of allocated blocks tagged with owner */
+size_t allocation_check_owner(int owner);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Only one in this many allocations gets its footer checked, its memory
+ * poisoned on malloc and free and its address tracked for cautious mode.
+ * Other blocks only carry a header magic value (1 or less: check all).
+ */
+extern int check_interval;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -37,6 +54,14 @@ void set_cautious_mode(bool cautious);
  */
 void set_noallocate_mode(bool noallocate);
 
+/*
+ * Set/unset threaded mode.
+ * In this mode, calls to malloc and free may come from several threads and
+ * take a lock.  SIGALRM must be blocked in every thread that makes them, so
+ * that the time limit cannot fire while the lock is held.
+ */
+void set_threaded_mode(bool threaded);
+
 /*
   Return whether any errors have occurred since last time checked
  */
@@ -58,9 +83,12 @@ void exception_cancel();
  */
 void trigger_exception(char *msg);
 
-#else /* !INTERNAL */
+#elif !defined(QBENCH)
 
-/* Tested program use our versions of malloc and free */
+/*
+ * Tested program use our versions of malloc and free, unless built as
+ * qbench with QBENCH defined
+ */
 #define malloc test_malloc
 #define free test_free
 
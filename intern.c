@@ -0,0 +1,149 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+#include "intern.h"
+
+/* Interned string, handed out as a pointer to data[] */
+typedef struct {
+    size_t refs;
+    size_t len;
+    uint32_t hash;
+    char data[];
+} istr_t;
+
+/* Slots of the first table, which doubles whenever it gets half full */
+#define INTERN_MIN_BITS 6
+
+/* Open-addressing table with linear probing, NULL until the first string */
+static istr_t **table = NULL;
+static int table_bits = 0;
+static size_t table_used = 0;
+
+static uint32_t str_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static istr_t *istr_of(const char *s)
+{
+    return (istr_t *) (s - offsetof(istr_t, data));
+}
+
+/* Move every string into a table of 1 << bits slots */
+static bool table_resize(int bits)
+{
+    size_t nslots = (size_t) 1 << bits;
+    istr_t **slots = malloc(nslots * sizeof(istr_t *));
+    if (!slots) {
+        return false;
+    }
+    memset(slots, 0, nslots * sizeof(istr_t *));
+
+    size_t old_slots = table ? (size_t) 1 << table_bits : 0;
+    for (size_t i = 0; i < old_slots; i++) {
+        if (table[i]) {
+            size_t j = table[i]->hash & (nslots - 1);
+            while (slots[j]) {
+                j = (j + 1) & (nslots - 1);
+            }
+            slots[j] = table[i];
+        }
+    }
+    free(table);
+    table = slots;
+    table_bits = bits;
+    return true;
+}
+
+const char *intern_get(const char *s, size_t len)
+{
+    uint32_t hash = str_hash(s, len);
+    size_t mask = table ? ((size_t) 1 << table_bits) - 1 : 0;
+    size_t i = hash & mask;
+    for (; table && table[i]; i = (i + 1) & mask) {
+        istr_t *e = table[i];
+        if (e->hash == hash && e->len == len && !memcmp(e->data, s, len)) {
+            e->refs++;
+            return e->data;
+        }
+    }
+
+    /* Not there yet: make room first, so the new string always fits */
+    if (2 * (table_used + 1) > mask + 1) {
+        if (!table_resize(table ? table_bits + 1 : INTERN_MIN_BITS)) {
+            return NULL;
+        }
+        mask = ((size_t) 1 << table_bits) - 1;
+        i = hash & mask;
+        while (table[i]) {
+            i = (i + 1) & mask;
+        }
+    }
+
+    istr_t *e = malloc(sizeof(istr_t) + len + 1);
+    if (!e) {
+        return NULL;
+    }
+    e->refs = 1;
+    e->len = len;
+    e->hash = hash;
+    memcpy(e->data, s, len);
+    e->data[len] = '\0';
+    table[i] = e;
+    table_used++;
+    return e->data;
+}
+
+/* Empty slot i, moving later strings of the same probe run into the hole */
+static void table_remove(size_t i)
+{
+    size_t mask = ((size_t) 1 << table_bits) - 1;
+    for (size_t j = (i + 1) & mask; table[j]; j = (j + 1) & mask) {
+        size_t home = table[j]->hash & mask;
+        /* Entry j may fill the hole unless its home lies in (i, j] */
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i] = NULL;
+}
+
+void intern_put(const char *s)
+{
+    if (!s) {
+        return;
+    }
+
+    istr_t *e = istr_of(s);
+    if (--e->refs > 0) {
+        return;
+    }
+
+    size_t mask = ((size_t) 1 << table_bits) - 1;
+    size_t i = e->hash & mask;
+    while (table[i] != e) {
+        i = (i + 1) & mask;
+    }
+    table_remove(i);
+    free(e);
+    if (!--table_used) {
+        free(table);
+        table = NULL;
+        table_bits = 0;
+    }
+}
+
+size_t intern_count()
+{
+    return table_used;
+}
@@ -0,0 +1,31 @@
+#ifndef LAB0_INTERN_H
+#define LAB0_INTERN_H
+
+/*
+ * Table of interned strings.
+ *
+ * Every distinct string is stored once, together with a count of the
+ * references handed out for it.  Callers share that copy and must not
+ * modify it.  The copy is freed when its last reference is dropped, and
+ * the table itself once no string is left in it.
+ */
+
+#include <stddef.h>
+
+/*
+ * Return the interned copy of s, which is len bytes long not counting the
+ * null terminator, adding one reference to it.
+ * Return NULL if could not allocate space.
+ */
+const char *intern_get(const char *s, size_t len);
+
+/*
+ * Drop a reference obtained from intern_get().
+ * No effect if s is NULL
+ */
+void intern_put(const char *s);
+
+/* Number of distinct strings in the table */
+size_t intern_count();
+
+#endif /* LAB0_INTERN_H */
@@ -0,0 +1,114 @@
+/* Hardware event counters for timed operations */
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perf.h"
+#include "report.h"
+
+const char *perf_event_names[PERF_NEVENTS] = {"instructions", "cache-misses",
+                                              "branch-misses"};
+
+/* perf_event_attr.config of each event */
+static const uint64_t perf_event_config[PERF_NEVENTS] = {
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+int perf_counters = 0;
+
+/* Event group of the counting thread; the first event leads it */
+static int perf_fd[PERF_NEVENTS] = {-1, -1, -1};
+static int perf_users = 0;
+static bool perf_warned = false;
+
+static void perf_close()
+{
+    for (int i = PERF_NEVENTS - 1; i >= 0; i--) {
+        if (perf_fd[i] >= 0)
+            close(perf_fd[i]);
+        perf_fd[i] = -1;
+    }
+}
+
+static bool perf_open()
+{
+    for (int i = 0; i < PERF_NEVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = perf_event_config[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1,
+                             i ? perf_fd[0] : -1, 0);
+        if (perf_fd[i] < 0) {
+            if (!perf_warned)
+                report(1, "Warning: cannot count %s: %s", perf_event_names[i],
+                       strerror(errno));
+            perf_warned = true;
+            perf_close();
+            return false;
+        }
+    }
+    ioctl(perf_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+bool perf_start()
+{
+    if (perf_users) {
+        perf_users++;
+        return true;
+    }
+    if (!perf_counters || !perf_open())
+        return false;
+    perf_users = 1;
+    return true;
+}
+
+void perf_stop()
+{
+    if (perf_users && --perf_users == 0)
+        perf_close();
+}
+
+void perf_read(perf_counts_t *c)
+{
+    struct {
+        uint64_t nr;
+        uint64_t values[PERF_NEVENTS];
+    } buf;
+
+    if (read(perf_fd[0], &buf, sizeof(buf)) != sizeof(buf)) {
+        memset(c, 0, sizeof(*c));
+        return;
+    }
+    for (int i = 0; i < PERF_NEVENTS; i++)
+        c->count[i] = buf.values[i];
+}
+
+void perf_diff(perf_counts_t *d,
+               const perf_counts_t *a,
+               const perf_counts_t *b)
+{
+    for (int i = 0; i < PERF_NEVENTS; i++)
+        d->count[i] = b->count[i] - a->count[i];
+}
+
+void perf_report(const perf_counts_t *c)
+{
+    report(1, "%s = %llu, %s = %llu, %s = %llu", perf_event_names[0],
+           (unsigned long long) c->count[0], perf_event_names[1],
+           (unsigned long long) c->count[1], perf_event_names[2],
+           (unsigned long long) c->count[2]);
+}
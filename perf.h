@@ -0,0 +1,52 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+/*
+ * Hardware event counters around measured operations, read through
+ * perf_event_open(2).  Counting is off unless perf_counters is set, and
+ * is skipped with a warning where the kernel does not provide the events.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NEVENTS
+} perf_event_t;
+
+/* Event counts at some point, or between two points */
+typedef struct {
+    uint64_t count[PERF_NEVENTS];
+} perf_counts_t;
+
+/* Names of the events, for reports */
+extern const char *perf_event_names[PERF_NEVENTS];
+
+/* Count events when nonzero */
+extern int perf_counters;
+
+/*
+ * Start counting events of the calling thread, if perf_counters is set.
+ * Calls nest.  Return false if events are not being counted, in which
+ * case perf_stop() must not be called.
+ */
+bool perf_start();
+
+/* Stop counting started by the matching perf_start() */
+void perf_stop();
+
+/* Read the current counts into c */
+void perf_read(perf_counts_t *c);
+
+/* Store in d the events counted from a to b */
+void perf_diff(perf_counts_t *d,
+               const perf_counts_t *a,
+               const perf_counts_t *b);
+
+/* Report the events in c */
+void perf_report(const perf_counts_t *c);
+
+#endif /* LAB0_PERF_H */
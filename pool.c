@@ -0,0 +1,204 @@
+#include <stdlib.h>
+
+#include "harness.h"
+#include "pool.h"
+
+/* Smallest slot is 1 << POOL_MIN_SHIFT bytes */
+#define POOL_MIN_SHIFT 5
+
+/* Number of size classes, the largest one holds 4096 bytes */
+#define POOL_CLASSES 8
+
+/* Slabs of each class start small and double up to the maximum size */
+#define SLAB_MIN_BYTES (4 << 10)
+#define SLAB_MAX_BYTES (4 << 20)
+
+/*
+ * Header in front of every block the pool gets from malloc.
+ * Slabs and large objects are kept on separate doubly-linked lists.
+ */
+typedef struct BLK {
+    struct BLK *next, *prev;
+} blk_t;
+
+typedef struct {
+    void *free;        /* Released slots, linked through their first word */
+    char *bump;        /* Next never-used slot of the newest slab */
+    char *end;         /* End of the newest slab */
+    size_t slab_bytes; /* Size of the next slab to allocate */
+} size_class_t;
+
+struct POOL {
+    size_class_t cls[POOL_CLASSES];
+    blk_t *slabs; /* Slabs of all size classes */
+    blk_t *large; /* Objects too large for any size class */
+    int users;    /* Queues sharing the pool */
+};
+
+/*
+ * Find the smallest class whose slots can hold size bytes.
+ * Return POOL_CLASSES if there is none.
+ */
+static int size_class(size_t size)
+{
+    int c = 0;
+    while (c < POOL_CLASSES && ((size_t) 1 << (c + POOL_MIN_SHIFT)) < size) {
+        c++;
+    }
+    return c;
+}
+
+/*
+ * Allocate a block with size bytes of usable memory and link it into list.
+ * Return NULL if could not allocate space.
+ */
+static void *blk_alloc(blk_t **list, size_t size)
+{
+    blk_t *b = malloc(sizeof(blk_t) + size);
+    if (!b) {
+        return NULL;
+    }
+
+    b->prev = NULL;
+    b->next = *list;
+    if (*list) {
+        (*list)->prev = b;
+    }
+    *list = b;
+    return b + 1;
+}
+
+/* Free every block on list */
+static void blk_free_all(blk_t *list)
+{
+    while (list) {
+        blk_t *b = list;
+        list = list->next;
+        free(b);
+    }
+}
+
+pool_t *pool_new()
+{
+    pool_t *p = malloc(sizeof(pool_t));
+    if (!p) {
+        return NULL;
+    }
+
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        p->cls[c].free = NULL;
+        p->cls[c].bump = NULL;
+        p->cls[c].end = NULL;
+        p->cls[c].slab_bytes = SLAB_MIN_BYTES;
+    }
+    p->slabs = NULL;
+    p->large = NULL;
+    p->users = 1;
+    return p;
+}
+
+void *pool_alloc(pool_t *p, size_t size)
+{
+    int c = size_class(size);
+    if (c == POOL_CLASSES) {
+        return blk_alloc(&p->large, size);
+    }
+
+    size_class_t *sc = &p->cls[c];
+    if (sc->free) {
+        void *obj = sc->free;
+        sc->free = *(void **) obj;
+        return obj;
+    }
+
+    if (sc->bump == sc->end) {
+        /* Newest slab used up, so get a bigger one */
+        char *mem = blk_alloc(&p->slabs, sc->slab_bytes);
+        if (!mem) {
+            return NULL;
+        }
+        sc->bump = mem;
+        sc->end = mem + sc->slab_bytes;
+        if (sc->slab_bytes < SLAB_MAX_BYTES) {
+            sc->slab_bytes <<= 1;
+        }
+    }
+
+    void *obj = sc->bump;
+    sc->bump += (size_t) 1 << (c + POOL_MIN_SHIFT);
+    return obj;
+}
+
+void pool_release(pool_t *p, void *obj, size_t size)
+{
+    int c = size_class(size);
+    if (c == POOL_CLASSES) {
+        blk_t *b = (blk_t *) obj - 1;
+        if (b->prev) {
+            b->prev->next = b->next;
+        } else {
+            p->large = b->next;
+        }
+        if (b->next) {
+            b->next->prev = b->prev;
+        }
+        free(b);
+        return;
+    }
+
+    size_class_t *sc = &p->cls[c];
+    *(void **) obj = sc->free;
+    sc->free = obj;
+}
+
+pool_t *pool_share(pool_t *p)
+{
+    p->users++;
+    return p;
+}
+
+bool pool_shared(pool_t *p)
+{
+    return p->users > 1;
+}
+
+/* Put the blocks of list src in front of those of *dst */
+static void blk_splice(blk_t **dst, blk_t *src)
+{
+    if (!src) {
+        return;
+    }
+
+    blk_t *last = src;
+    while (last->next) {
+        last = last->next;
+    }
+    last->next = *dst;
+    if (*dst) {
+        (*dst)->prev = last;
+    }
+    *dst = src;
+}
+
+bool pool_merge(pool_t *dst, pool_t *src)
+{
+    if (src->users > 1) {
+        return false;
+    }
+
+    blk_splice(&dst->slabs, src->slabs);
+    blk_splice(&dst->large, src->large);
+    free(src);
+    return true;
+}
+
+void pool_destroy(pool_t *p)
+{
+    if (!p || --p->users > 0) {
+        return;
+    }
+
+    blk_free_all(p->slabs);
+    blk_free_all(p->large);
+    free(p);
+}
@@ -0,0 +1,62 @@
+#ifndef LAB0_POOL_H
+#define LAB0_POOL_H
+
+/*
+ * Slab allocator for queue elements.
+ *
+ * Objects are carved out of large slabs, sorted into power-of-two size
+ * classes.  Released objects go onto a per-class free list and are handed
+ * out again by later allocations, so steady-state insert/remove churn makes
+ * no calls to malloc at all.  Destroying a pool releases everything it ever
+ * handed out with one free per slab.
+ *
+ * Queues that exchange elements share one pool, which then lives until
+ * the last of them destroys it.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct POOL pool_t;
+
+/*
+ * Create empty pool.
+ * Return NULL if could not allocate space.
+ */
+pool_t *pool_new();
+
+/*
+ * Allocate an object of the given size from the pool.
+ * Objects too large for any size class get a block of their own.
+ * Return NULL if could not allocate space.
+ */
+void *pool_alloc(pool_t *p, size_t size);
+
+/*
+ * Return an object to the pool.
+ * size must be the same value passed to pool_alloc().
+ */
+void pool_release(pool_t *p, void *obj, size_t size);
+
+/* Add a user of pool p and return it */
+pool_t *pool_share(pool_t *p);
+
+/* Tell whether pool p has more than one user */
+bool pool_shared(pool_t *p);
+
+/*
+ * Move every block of pool src into dst and free src, which must have a
+ * single user.  Objects from src are then released to dst.  Slots that
+ * src had free are not handed out again.
+ * Return false, changing nothing, if src is shared.
+ */
+bool pool_merge(pool_t *dst, pool_t *src);
+
+/*
+ * Drop a user of the pool.  The last one frees the pool together with
+ * every object still allocated from it.
+ * No effect if p is NULL
+ */
+void pool_destroy(pool_t *p);
+
+#endif /* LAB0_POOL_H */
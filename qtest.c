@@ -1,16 +1,17 @@
 /* Implementation of testing code for queue code */
 
 #include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h> /* strcasecmp */
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 
 /* Our program needs to use regular malloc/free */
@@ -31,8 +32,14 @@
  */
 #include "queue.h"
 
+#include "bench.h"
 #include "console.h"
+#include "cqueue.h"
+#include "perf.h"
+#include "random.h"
 #include "report.h"
+#include "stress.h"
+#include "trace.h"
 
 /* Settable parameters */
 
@@ -52,12 +59,49 @@ static queue_t *q = NULL;
 /* Number of elements in queue */
 static size_t qcnt = 0;
 
+/*
+ * Queue of the table below, with its expected number of elements.
+ * Entries whose queues have shared storage, through q_split(), q_concat()
+ * or interned strings, are of the same family.
+ */
+typedef struct {
+    char *name;
+    queue_t *q;
+    size_t cnt;
+    size_t family;
+} named_queue_t;
+
+/*
+ * Table of named queues.  Commands work on the selected one through q and
+ * qcnt, which store_selected() copies back into its entry.
+ */
+static named_queue_t *queues = NULL;
+static size_t nqueues = 0, queues_cap = 0;
+static size_t selected = 0;
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_QUEUE;
 static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Seed of the random number generator, drawn from the kernel at start */
+static int seed = 0;
+
+/* Element layout options, applied when the next queue is created */
+static int coalloc = 0;
+static int pool = 0;
+static int sso = 0;
+static int unrolled = 0;
+static int dlist = 0;
+static int intern = 0;
+
+/* Free queues through q_free_deferred() */
+static int deferred = 0;
+
+/* Compact the queue after every sort command */
+static int compact = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -68,15 +112,33 @@ static bool do_new(int argc, char *argv[]);
 static bool do_free(int argc, char *argv[]);
 static bool do_insert_head(int argc, char *argv[]);
 static bool do_insert_tail(int argc, char *argv[]);
+static bool do_insert_sorted(int argc, char *argv[]);
 static bool do_remove_head(int argc, char *argv[]);
+static bool do_remove_tail(int argc, char *argv[]);
 static bool do_remove_head_quiet(int argc, char *argv[]);
 static bool do_reverse(int argc, char *argv[]);
 static bool do_size(int argc, char *argv[]);
+static bool do_split(int argc, char *argv[]);
+static bool do_concat(int argc, char *argv[]);
+static bool do_select(int argc, char *argv[]);
+static bool do_queues(int argc, char *argv[]);
 static bool do_sort(int argc, char *argv[]);
+static bool do_compact(int argc, char *argv[]);
 static bool do_show(int argc, char *argv[]);
+static bool do_compile(int argc, char *argv[]);
+static bool do_replay(int argc, char *argv[]);
+static bool do_bench(int argc, char *argv[]);
+static bool do_stress(int argc, char *argv[]);
+static bool do_reclaim(int argc, char *argv[]);
 
 static void queue_init();
 
+/* Restart the random number generator whenever its seed is set */
+static void seed_changed(int oldval)
+{
+    random_seed(seed);
+}
+
 static void console_init()
 {
     add_cmd("new", do_new, "                | Create new queue");
@@ -87,23 +149,131 @@ static void console_init()
     add_cmd("it", do_insert_tail,
             " str [n]        | Insert string str at tail of queue n times. "
             "Generate random string(s) if str equals RAND. (default: n == 1)");
+    add_cmd("is", do_insert_sorted,
+            " str [n]        | Insert string str into sorted queue n times. "
+            "Generate random string(s) if str equals RAND. (default: n == 1)");
     add_cmd("rh", do_remove_head,
-            " [str]          | Remove from head of queue.  Optionally compare "
-            "to expected value str");
+            " [str] [n]      | Remove from head of queue n times.  Optionally "
+            "compare last removed value to expected value str "
+            "(default: n == 1)");
+    add_cmd("rt", do_remove_tail,
+            " [str] [n]      | Remove from tail of queue n times.  Optionally "
+            "compare last removed value to expected value str "
+            "(default: n == 1)");
     add_cmd(
         "rhq", do_remove_head_quiet,
-        "                | Remove from head of queue without reporting value.");
+        " [n]            | Remove from head of queue n times without reporting "
+        "value (default: n == 1)");
     add_cmd("reverse", do_reverse, "                | Reverse queue");
     add_cmd("sort", do_sort, "                | Sort queue in ascending order");
+    add_cmd("compact", do_compact,
+            "                | Move elements into memory in queue order");
     add_cmd("size", do_size,
             " [n]            | Compute queue size n times (default: n == 1)");
+    add_cmd("split", do_split,
+            " k name         | Move first k elements of queue to new queue name");
+    add_cmd("concat", do_concat,
+            " name           | Move elements of queue name to tail of queue, "
+            "then free queue name");
+    add_cmd("select", do_select,
+            " name           | Work on queue name, creating it if needed");
+    add_cmd("use", do_select, " name           | Same as select");
+    add_cmd("queues", do_queues,
+            "                | List named queues with their sizes");
+    add_cmd("reclaim", do_reclaim,
+            "                | Finish deferred frees, then check for leaks if "
+            "no queue is left");
     add_cmd("show", do_show, "                | Show queue contents");
+    add_cmd("compile", do_compile,
+            " src dst        | Compile trace file src into binary trace dst");
+    add_cmd("replay", do_replay,
+            " file           | Run binary trace file against the queue");
+    add_cmd("bench", do_bench,
+            " op n [arg] [csv|json file] | Time n runs of op (ih, it, is, "
+            "itsort, rh, reverse, sort, size or free), optionally appending "
+            "results to file");
+    add_cmd("stress", do_stress,
+            " kind p c n     | Move n strings from each of p producer threads "
+            "to c consumer threads through a queue of kind mpmc, spsc or "
+            "mutex, reporting ops/s");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("check", &check_interval,
+              "Check and poison one in every n allocations (1: all of them)",
+              NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("coalloc", &coalloc,
+              "Co-allocate elements with their strings in new queues", NULL);
+    add_param("pool", &pool, "Allocate elements of new queues from slabs",
+              NULL);
+    add_param("sso", &sso, "Keep short strings inside elements of new queues",
+              NULL);
+    add_param("unrolled", &unrolled,
+              "Keep elements of new queues in chunks instead of a list", NULL);
+    add_param("dlist", &dlist,
+              "Link elements of new queues both ways for O(1) reverse", NULL);
+    add_param("intern", &intern,
+              "Share one copy of equal strings in new queues", NULL);
+    add_param("deferred", &deferred,
+              "Free queues a slice at a time during later operations", NULL);
+    add_param("compact", &compact, "Compact the queue after sorting it",
+              NULL);
+    add_param("threads", &q_sort_threads, "Number of threads used by sort",
+              NULL);
+    add_param("seed", &seed, "Seed of the random number generator",
+              seed_changed);
+    add_param("perf", &perf_counters,
+              "Count hardware events in time and simulation commands", NULL);
+}
+
+/* Translate layout options into flags for q_new_flags() */
+static unsigned int queue_flags()
+{
+    unsigned int flags = 0;
+    if (coalloc)
+        flags |= Q_COALLOC;
+    if (pool)
+        flags |= Q_POOL;
+    if (sso)
+        flags |= Q_SSO;
+    if (unrolled)
+        flags |= Q_UNROLLED;
+    if (dlist)
+        flags |= Q_DLIST;
+    if (intern)
+        flags |= Q_INTERN;
+    return flags;
+}
+
+/* Move every entry of the family of entry j into that of entry i */
+static void join_family(size_t i, size_t j)
+{
+    size_t from = queues[j].family;
+    for (size_t k = 0; k < nqueues; k++) {
+        if (queues[k].family == from)
+            queues[k].family = queues[i].family;
+    }
+}
+
+/*
+ * Count the blocks still allocated by the family of entry i, whose queue
+ * was just freed.  Blocks are tagged with the entry selected when they were
+ * allocated.  Return 0 while another queue of the family may still use them.
+ */
+static size_t family_blocks(size_t i)
+{
+    size_t blocks = 0;
+    for (size_t k = 0; k < nqueues; k++) {
+        if (queues[k].family != queues[i].family)
+            continue;
+        if (queues[k].q)
+            return 0;
+        blocks += allocation_check_owner(k);
+    }
+    return blocks;
 }
 
 static bool do_new(int argc, char *argv[])
@@ -121,14 +291,90 @@ static bool do_new(int argc, char *argv[])
     error_check();
 
     if (exception_setup(true))
-        q = q_new();
+        q = q_new_flags(queue_flags());
     exception_cancel();
     qcnt = 0;
     show_queue(3);
 
+    /* Interned strings are shared by every queue using them */
+    for (size_t i = 0; q && (q->flags & Q_INTERN) && i < nqueues; i++) {
+        if (i != selected && queues[i].q && (queues[i].q->flags & Q_INTERN))
+            join_family(selected, i);
+    }
+
     return ok && !error_check();
 }
 
+/* Free a queue, at once or through later operations */
+static void release_queue(queue_t *fq)
+{
+    if (deferred)
+        q_free_deferred(fq);
+    else
+        q_free(fq);
+}
+
+static void store_selected()
+{
+    queues[selected].q = q;
+    queues[selected].cnt = qcnt;
+}
+
+/*
+ * Return the index of queue name in the table, adding an entry without
+ * queue for it if create is set.  Return -1 if there is none.
+ */
+static int find_queue(char *name, bool create)
+{
+    for (size_t i = 0; i < nqueues; i++) {
+        if (!strcmp(queues[i].name, name))
+            return i;
+    }
+    if (!create)
+        return -1;
+
+    if (nqueues == queues_cap) {
+        queues_cap = queues_cap ? 2 * queues_cap : 16;
+        queues = realloc(queues, queues_cap * sizeof(named_queue_t));
+        if (!queues)
+            report_event(MSG_FATAL, "Couldn't allocate space for queues");
+    }
+    named_queue_t *e = &queues[nqueues];
+    e->name = strdup(name);
+    if (!e->name)
+        report_event(MSG_FATAL, "Couldn't allocate space for queues");
+    e->q = NULL;
+    e->cnt = 0;
+    e->family = nqueues;
+    return nqueues++;
+}
+
+/* Free the queue of an entry other than the selected one */
+static void free_entry(named_queue_t *e)
+{
+    if (e->cnt > big_queue_size)
+        set_cautious_mode(false);
+    if (exception_setup(true))
+        release_queue(e->q);
+    exception_cancel();
+    set_cautious_mode(true);
+    e->q = NULL;
+    e->cnt = 0;
+}
+
+/*
+ * Tell whether queues other than the selected one hold storage, which
+ * then keeps the allocation check from expecting zero blocks left.
+ */
+static bool others_allocated()
+{
+    for (size_t i = 0; i < nqueues; i++) {
+        if (i != selected && queues[i].q)
+            return true;
+    }
+    return false;
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -144,7 +390,7 @@ static bool do_free(int argc, char *argv[])
     if (qcnt > big_queue_size)
         set_cautious_mode(false);
     if (exception_setup(true))
-        q_free(q);
+        release_queue(q);
     exception_cancel();
     set_cautious_mode(true);
 
@@ -152,35 +398,158 @@ static bool do_free(int argc, char *argv[])
     qcnt = 0;
     show_queue(3);
 
-    size_t bcnt = allocation_check();
+    store_selected();
+    size_t bcnt = q_reclaim_pending() ? 0 : family_blocks(selected);
     if (bcnt > 0) {
-        report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
+        report(1, "ERROR: Freed queue, but %zu blocks are still allocated",
                bcnt);
         ok = false;
     }
 
     return ok && !error_check();
 }
+
+/*
+ * Fill bufs[0..n-1] with random strings of MIN_RANDSTR_LEN to
+ * MAX_RANDSTR_LEN - 1 letters, each length equally likely, and point
+ * sv[i] at bufs[i] unless sv is NULL.
+ * Each string is cut from one 64-bit random draw: multiplying the draw
+ * by a range moves a uniform digit of that range into the high word,
+ * so no value is ever rejected.
+ */
+static void fill_rand_strings(char (*bufs)[MAX_RANDSTR_LEN], char **sv, int n)
+{
+    for (int i = 0; i < n; i++) {
+        uint64_t r = random_u64();
+        __uint128_t m = (__uint128_t) r * (MAX_RANDSTR_LEN - MIN_RANDSTR_LEN);
+        size_t len = MIN_RANDSTR_LEN + (size_t) (m >> 64);
+        r = (uint64_t) m;
+
+        char *buf = bufs[i];
+        for (size_t k = 0; k < len; k++) {
+            m = (__uint128_t) r * (sizeof charset - 1);
+            buf[k] = charset[m >> 64];
+            r = (uint64_t) m;
+        }
+        buf[len] = '\0';
+        if (sv)
+            sv[i] = buf;
+    }
+}
+
+/* Number of strings, random or not, inserted by each bulk insertion */
+#define RAND_BATCH 256
+
+/*
+ * Count a failed insertion of s, which is an error once fail_limit of them
+ * happened.  Return false in that case.
+ */
+static bool insert_failed(const char *s)
+{
+    fail_count++;
+    if (fail_count < fail_limit) {
+        report(2, "Insertion of %s failed", s);
+        return true;
+    }
+    report(1, "ERROR: Insertion of %s failed (%d failures total)", s,
+           fail_count);
+    return false;
+}
+
 /*
- * TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
+ * Insert reps copies of inserts at head or tail of the queue, or reps
+ * random strings if need_rand, through the bulk API.  A failed insertion
+ * is counted like a failed q_insert_head/q_insert_tail call.
+ * Each batch is chained and spliced with SIGALRM blocked, so the time limit
+ * fires between batches and never leaves a chain outside the queue.
+ * Return the number of strings inserted, or -1 on error.
  */
-static void fill_rand_string(char *buf, size_t buf_size)
+static int insert_reps(bool tail, char *inserts, bool need_rand, int reps)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    static char rand_bufs[RAND_BATCH][MAX_RANDSTR_LEN];
+    char *sv[RAND_BATCH];
+    int done = 0, inserted = 0;
+    bool ok = true;
+    sigset_t alrm, old;
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+
+    sv[0] = inserts;
+    while (ok && done < reps) {
+        int nstr = 1, n = reps - done, cnt;
+        if (n > RAND_BATCH)
+            n = RAND_BATCH;
+        if (need_rand) {
+            fill_rand_strings(rand_bufs, sv, n);
+            nstr = n;
+        }
+
+        pthread_sigmask(SIG_BLOCK, &alrm, &old);
+        if (n == 1)
+            cnt = tail ? q_insert_tail(q, sv[0]) : q_insert_head(q, sv[0]);
+        else if (tail)
+            cnt = q_insert_tail_bulk(q, sv, nstr, n);
+        else
+            cnt = q_insert_head_bulk(q, sv, nstr, n);
+        qcnt += cnt;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        done += cnt;
+        inserted += cnt;
+
+        if (cnt < n) {
+            /* The insertion following the last successful one failed */
+            done++;
+            ok = insert_failed(sv[cnt % nstr]);
+        }
+        ok = ok && !error_check();
+    }
+    return ok ? inserted : -1;
+}
+
+/*
+ * Check in simulation mode how the time of operation name depends on the
+ * queue length.  Commands with a bulk variant take a count selecting it.
+ */
+static bool simulate(int argc, char *argv[], char *name, char *bulk_name)
+{
+    int count = 1;
+    if (!bulk_name && argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments in simulation mode", argv[0]);
+        return false;
+    }
+    if (argc == 2 && (!get_int(argv[1], &count) || count < 1)) {
+        report(1, "Invalid count '%s'", argv[1]);
+        return false;
+    }
 
-    for (size_t n = 0; n < len; n++) {
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+    const dut_op_t *op = dut_find(count > 1 ? bulk_name : name);
+    unsigned int flags = queue_flags();
+    bool ok = dut_check(op, count, flags);
+    if (dut_expect(op, flags) == DUT_LINEAR) {
+        if (!ok) {
+            report(1, "ERROR: Probably constant time, expected linear time");
+            return false;
+        }
+        report(1, "Probably not constant time, as expected");
+        return ok;
+    }
+    if (!ok) {
+        report(1, "ERROR: Probably not constant time");
+        return false;
     }
-    buf[len] = '\0';
+    report(1, "Probably constant time");
+    return ok;
 }
 
 static bool do_insert_head(int argc, char *argv[])
 {
-    char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    if (simulation)
+        return simulate(argc, argv, "insert_head", "insert_head_bulk");
+
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -196,51 +565,43 @@ static bool do_insert_head(int argc, char *argv[])
         }
     }
 
-    if (!strcmp(inserts, "RAND")) {
+    if (!strcmp(inserts, "RAND"))
         need_rand = true;
-        inserts = randstr_buf;
-    }
 
     if (!q)
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
     if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = q_insert_head(q, inserts);
-            if (rval) {
-                qcnt++;
-                if (!q->head->value) {
-                    report(1, "ERROR: Failed to save copy of string in list");
-                    ok = false;
-                } else if (r == 0 && inserts == q->head->value) {
-                    report(1,
-                           "ERROR: Need to allocate and copy string for new "
-                           "list element");
-                    ok = false;
-                    break;
-                } else if (r == 1 && lasts == q->head->value) {
-                    report(1,
-                           "ERROR: Need to allocate separate string for each "
-                           "list element");
-                    ok = false;
-                    break;
-                }
-                lasts = q->head->value;
-            } else {
-                fail_count++;
-                if (fail_count < fail_limit)
-                    report(2, "Insertion of %s failed", inserts);
-                else {
+        int cnt = insert_reps(false, inserts, need_rand, reps);
+        ok = cnt >= 0;
+        if (cnt > 0) {
+            q_iter_t it;
+            list_ele_t *e = q_iter_first(q, &it);
+            list_ele_t *next = cnt > 1 ? q_iter_next(&it) : NULL;
+            if (!e->value) {
+                report(1, "ERROR: Failed to save copy of string in list");
+                ok = false;
+            } else if (!need_rand && inserts == e->value) {
+                report(1,
+                       "ERROR: Need to allocate and copy string for new "
+                       "list element");
+                ok = false;
+            } else if (q->flags & Q_INTERN) {
+                /* Interned strings are meant to be shared */
+                if (next && next->value != e->value &&
+                    !strcmp(next->value, e->value)) {
                     report(1,
-                           "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
+                           "ERROR: Equal strings need to share one interned "
+                           "copy");
                     ok = false;
                 }
+            } else if (next && next->value == e->value) {
+                report(1,
+                       "ERROR: Need to allocate separate string for each "
+                       "list element");
+                ok = false;
             }
-            ok = ok && !error_check();
         }
     }
     exception_cancel();
@@ -251,23 +612,72 @@ static bool do_insert_head(int argc, char *argv[])
 
 static bool do_insert_tail(int argc, char *argv[])
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
+    if (simulation)
+        return simulate(argc, argv, "insert_tail", "insert_tail_bulk");
+
+    int reps = 1;
+    bool ok = true, need_rand = false;
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    char *inserts = argv[1];
+    if (argc == 3) {
+        if (!get_int(argv[2], &reps)) {
+            report(1, "Invalid number of insertions '%s'", argv[2]);
             return false;
         }
-        bool ok = is_insert_tail_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
+    }
+
+    if (!strcmp(inserts, "RAND"))
+        need_rand = true;
+
+    if (!q)
+        report(3, "Warning: Calling insert tail on null queue");
+    error_check();
+
+    if (exception_setup(true)) {
+        int cnt = insert_reps(true, inserts, need_rand, reps);
+        ok = cnt >= 0;
+        if (cnt > 0 && !q->tail->value) {
+            report(1, "ERROR: Failed to save copy of string in list");
+            ok = false;
+        }
+    }
+    exception_cancel();
+    show_queue(3);
+    return ok;
+}
+
+/* Check that the elements of queue sq are in ascending order */
+static bool check_sorted(queue_t *sq)
+{
+    int cnt = q_size(sq);
+    if (!sq)
+        return true;
+
+    q_iter_t it;
+    list_ele_t *e = q_iter_first(sq, &it), *next;
+    for (; e && --cnt; e = next) {
+        next = q_iter_next(&it);
+        /* Ensure each element in ascending order */
+        /* FIXME: add an option to specify sorting order */
+        /* Cached prefixes settle most pairs without touching strings */
+        if (e->prefix > next->prefix ||
+            (e->prefix == next->prefix && strcmp(e->value, next->value) > 0)) {
+            report(1, "ERROR: Not sorted in ascending order");
             return false;
         }
-        report(1, "Probably constant time");
-        return ok;
     }
+    return true;
+}
 
-    char randstr_buf[MAX_RANDSTR_LEN];
+/* Insert into a queue kept in ascending order, one string at a time */
+static bool do_insert_sorted(int argc, char *argv[])
+{
     int reps = 1;
-    bool ok = true, need_rand = false;
+    bool ok = true;
     if (argc != 2 && argc != 3) {
         report(1, "%s needs 1-2 arguments", argv[0]);
         return false;
@@ -280,50 +690,44 @@ static bool do_insert_tail(int argc, char *argv[])
             return false;
         }
     }
-
-    if (!strcmp(inserts, "RAND")) {
-        need_rand = true;
-        inserts = randstr_buf;
-    }
+    bool need_rand = !strcmp(inserts, "RAND");
 
     if (!q)
-        report(3, "Warning: Calling insert tail on null queue");
+        report(3, "Warning: Calling insert sorted on null queue");
     error_check();
 
     if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = q_insert_tail(q, inserts);
-            if (rval) {
-                qcnt++;
-                if (!q->head->value) {
-                    report(1, "ERROR: Failed to save copy of string in list");
-                    ok = false;
-                }
-            } else {
-                fail_count++;
-                if (fail_count < fail_limit)
-                    report(2, "Insertion of %s failed", inserts);
-                else {
-                    report(1,
-                           "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
-                    ok = false;
-                }
+        static char rand_buf[1][MAX_RANDSTR_LEN];
+        for (int i = 0; ok && i < reps; i++) {
+            char *s = inserts;
+            if (need_rand) {
+                fill_rand_strings(rand_buf, NULL, 1);
+                s = rand_buf[0];
             }
+            if (q_insert_sorted(q, s))
+                qcnt++;
+            else
+                ok = insert_failed(s);
             ok = ok && !error_check();
         }
     }
     exception_cancel();
+
+    ok = check_sorted(q) && ok;
     show_queue(3);
     return ok;
 }
 
-static bool do_remove_head(int argc, char *argv[])
+/* Remove elements from the head or the tail of the queue */
+static bool remove_elems(int argc, char *argv[], bool tail)
 {
-    if (argc != 1 && argc != 2) {
-        report(1, "%s needs 0-1 arguments", argv[0]);
+    int reps = 1;
+    if (argc != 1 && argc != 2 && argc != 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 3 && !get_int(argv[2], &reps)) {
+        report(1, "Invalid number of removals '%s'", argv[2]);
         return false;
     }
 
@@ -354,17 +758,28 @@ static bool do_remove_head(int argc, char *argv[])
     removes[string_length + STRINGPAD] = '\0';
 
     if (!q)
-        report(3, "Warning: Calling remove head on null queue");
+        report(3, "Warning: Calling remove %s on null queue",
+               tail ? "tail" : "head");
     else if (!q->head)
-        report(3, "Warning: Calling remove head on empty queue");
+        report(3, "Warning: Calling remove %s on empty queue",
+               tail ? "tail" : "head");
     error_check();
 
-    bool rval = false;
-    if (exception_setup(true))
-        rval = q_remove_head(q, removes, string_length + 1);
+    int cnt = 0;
+    if (exception_setup(true)) {
+        if (tail) {
+            while (cnt < reps && q_remove_tail(q, removes, string_length + 1))
+                cnt++;
+        } else if (reps == 1) {
+            cnt = q_remove_head(q, removes, string_length + 1);
+        } else {
+            cnt = q_remove_head_bulk(q, removes, string_length + 1, reps);
+        }
+    }
     exception_cancel();
+    bool rval = cnt > 0 && cnt == reps;
 
-    if (rval) {
+    if (cnt > 0) {
         removes[string_length + STRINGPAD] = '\0';
         if (removes[0] == '\0') {
             report(1, "ERROR: Failed to store removed value");
@@ -380,14 +795,16 @@ static bool do_remove_head(int argc, char *argv[])
             i++;
         if (i != string_length + STRINGPAD) {
             report(1,
-                   "ERROR: copying of string in remove_head overflowed "
-                   "destination buffer.");
+                   "ERROR: copying of string in remove_%s overflowed "
+                   "destination buffer.",
+                   tail ? "tail" : "head");
             ok = false;
         } else {
             report(2, "Removed %s from queue", removes);
         }
-        qcnt--;
-    } else {
+        qcnt -= cnt;
+    }
+    if (!rval) {
         fail_count++;
         if (!check && fail_count < fail_limit) {
             report(2, "Removal from queue failed");
@@ -411,10 +828,27 @@ static bool do_remove_head(int argc, char *argv[])
     return ok && !error_check();
 }
 
+static bool do_remove_head(int argc, char *argv[])
+{
+    if (simulation)
+        return simulate(argc, argv, "remove_head", "remove_head_bulk");
+    return remove_elems(argc, argv, false);
+}
+
+static bool do_remove_tail(int argc, char *argv[])
+{
+    return remove_elems(argc, argv, true);
+}
+
 static bool do_remove_head_quiet(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    int reps = 1;
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 2 && !get_int(argv[1], &reps)) {
+        report(1, "Invalid number of removals '%s'", argv[1]);
         return false;
     }
 
@@ -425,15 +859,20 @@ static bool do_remove_head_quiet(int argc, char *argv[])
         report(3, "Warning: Calling remove head on empty queue");
     error_check();
 
-    bool rval = false;
-    if (exception_setup(true))
-        rval = q_remove_head(q, NULL, 0);
+    int cnt = 0;
+    if (exception_setup(true)) {
+        if (reps == 1)
+            cnt = q_remove_head(q, NULL, 0);
+        else
+            cnt = q_remove_head_bulk(q, NULL, 0, reps);
+    }
     exception_cancel();
 
-    if (rval) {
-        report(2, "Removed element from queue");
-        qcnt--;
-    } else {
+    if (cnt > 0) {
+        report(2, "Removed %d element(s) from queue", cnt);
+        qcnt -= cnt;
+    }
+    if (cnt <= 0 || cnt != reps) {
         fail_count++;
         if (fail_count < fail_limit)
             report(2, "Removal failed");
@@ -449,6 +888,9 @@ static bool do_remove_head_quiet(int argc, char *argv[])
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, "reverse", NULL);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -470,19 +912,8 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok = is_size_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(argc, argv, "size", NULL);
 
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
@@ -531,38 +962,60 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
-bool do_sort(int argc, char *argv[])
+/* Check the sizes that q_split() and q_concat() left in q and entry e */
+static bool check_sizes(named_queue_t *e)
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    int cnt = q_size(q), ecnt = q_size(e->q);
+    if (cnt != (int) qcnt || ecnt != (int) e->cnt) {
+        report(1,
+               "ERROR: Queue sizes are %d and %d (%s), but correct values "
+               "are %d and %d",
+               cnt, ecnt, e->name, (int) qcnt, (int) e->cnt);
+        return false;
+    }
+    return true;
+}
+
+static bool do_split(int argc, char *argv[])
+{
+    int k;
+    if (argc != 3) {
+        report(1, "%s needs 2 arguments", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &k)) {
+        report(1, "Invalid number of elements '%s'", argv[1]);
+        return false;
+    }
+    int i = find_queue(argv[2], true);
+    if (i == selected || queues[i].q) {
+        report(1, "ERROR: Queue %s already exists", argv[2]);
         return false;
     }
+    named_queue_t *e = &queues[i];
 
     if (!q)
-        report(3, "Warning: Calling sort on null queue");
-    error_check();
-
-    int cnt = q_size(q);
-    if (cnt < 2)
-        report(3, "Warning: Calling sort on single node");
+        report(3, "Warning: Calling split on null queue");
     error_check();
 
-    set_noallocate_mode(true);
+    join_family(selected, i);
     if (exception_setup(true))
-        q_sort(q);
+        e->q = q_split(q, k);
     exception_cancel();
-    set_noallocate_mode(false);
 
     bool ok = true;
-    if (q) {
-        for (list_ele_t *e = q->head; e && --cnt; e = e->next) {
-            /* Ensure each element in ascending order */
-            /* FIXME: add an option to specify sorting order */
-            if (strcasecmp(e->value, e->next->value) > 0) {
-                report(1, "ERROR: Not sorted in ascending order");
-                ok = false;
-                break;
-            }
+    if (e->q) {
+        e->cnt = k <= 0 ? 0 : k < (int) qcnt ? k : qcnt;
+        qcnt -= e->cnt;
+        ok = check_sizes(e);
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Split of queue failed");
+        } else {
+            report(1, "ERROR: Split of queue failed (%d failures total)",
+                   fail_count);
+            ok = false;
         }
     }
 
@@ -570,25 +1023,225 @@ bool do_sort(int argc, char *argv[])
     return ok && !error_check();
 }
 
-static bool show_queue(int vlevel)
+static bool do_concat(int argc, char *argv[])
 {
-    bool ok = true;
-    if (verblevel < vlevel)
-        return true;
+    if (simulation)
+        return simulate(argc, argv, "concat", NULL);
 
-    int cnt = 0;
-    if (!q) {
-        report(vlevel, "q = NULL");
-        return true;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
     }
+    int i = find_queue(argv[1], false);
+    if (i < 0 || i == selected) {
+        report(1, "ERROR: %s is not another queue", argv[1]);
+        return false;
+    }
+    named_queue_t *e = &queues[i];
+
+    if (!q)
+        report(3, "Warning: Calling concat on null queue");
+    if (!e->q)
+        report(3, "Warning: Calling concat with null queue %s", e->name);
+    error_check();
+
+    join_family(selected, i);
+
+    /* Only merging two pools may free storage */
+    bool done = false;
+    set_noallocate_mode(!q || !e->q || q->pool == e->q->pool);
+    if (exception_setup(true))
+        done = q_concat(q, e->q);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    bool ok = true;
+    if (done) {
+        qcnt += e->cnt;
+        e->cnt = 0;
+        ok = check_sizes(e);
+        free_entry(e);
+    } else if (q && e->q) {
+        report(1, "ERROR: Concatenation of queues failed");
+        ok = false;
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool do_reclaim(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    error_check();
+
+    set_cautious_mode(false);
+    if (exception_setup(true))
+        q_reclaim();
+    exception_cancel();
+    set_cautious_mode(true);
+
+    bool ok = true;
+    size_t bcnt = q || others_allocated() ? 0 : allocation_check();
+    if (bcnt > 0) {
+        report(1, "ERROR: Freed queues, but %lu blocks are still allocated",
+               bcnt);
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+static bool do_select(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    store_selected();
+    selected = find_queue(argv[1], true);
+    set_alloc_owner(selected);
+    q = queues[selected].q;
+    qcnt = queues[selected].cnt;
+    show_queue(3);
+    return true;
+}
+
+static bool do_queues(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    store_selected();
+    for (size_t i = 0; i < nqueues; i++) {
+        named_queue_t *e = &queues[i];
+        if (e->q)
+            report(1, "%c %s: %zu elements", i == selected ? '*' : ' ',
+                   e->name, e->cnt);
+        else
+            report(1, "%c %s: NULL", i == selected ? '*' : ' ', e->name);
+    }
+    return true;
+}
+
+/* Hash of the strings of queue sq in order, to tell if they changed */
+static uint64_t queue_digest(queue_t *sq)
+{
+    uint64_t h = 14695981039346656037ull;
+    q_iter_t it;
+    for (list_ele_t *e = q_iter_first(sq, &it); e; e = q_iter_next(&it)) {
+        for (const char *c = e->value; *c; c++)
+            h = (h ^ (unsigned char) *c) * 1099511628211ull;
+        h = (h ^ 0xff) * 1099511628211ull;
+    }
+    return h;
+}
+
+/*
+ * Compact the selected queue, checking that it still holds the same
+ * strings in the same order.  A failed compaction counts like a failed
+ * insertion.
+ */
+static bool compact_queue()
+{
+    uint64_t digest = queue_digest(q);
+    bool ok = true, done = false;
+    if (exception_setup(true))
+        done = q_compact(q);
+    exception_cancel();
+
+    if (!done && q) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Compaction failed");
+        } else {
+            report(1, "ERROR: Compaction failed (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
+    }
+    if (queue_digest(q) != digest) {
+        report(1, "ERROR: Compaction changed the elements of the queue");
+        ok = false;
+    }
+    return ok;
+}
+
+bool do_sort(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!q)
+        report(3, "Warning: Calling sort on null queue");
+    error_check();
+
+    int cnt = q_size(q);
+    if (cnt < 2)
+        report(3, "Warning: Calling sort on single node");
+    error_check();
+
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        q_sort(q);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    bool ok = true;
+    if (compact && q)
+        ok = compact_queue();
+    ok = check_sorted(q) && ok;
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool do_compact(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!q)
+        report(3, "Warning: Calling compact on null queue");
+    error_check();
+
+    bool ok = compact_queue();
+    show_queue(3);
+    return ok && !error_check();
+}
 
-    report_noreturn(vlevel, "q = [");
-    list_ele_t *e = q->head;
+/* Show the elements of queue sq, called name, which should hold n of them */
+static bool show_elems(int vlevel, char *name, queue_t *sq, size_t n)
+{
+    bool ok = true;
+    int cnt = 0;
+    if (!sq) {
+        report(vlevel, "%s = NULL", name);
+        return true;
+    }
+
+    report_noreturn(vlevel, "%s = [", name);
+    q_iter_t it;
+    list_ele_t *e = q_iter_first(sq, &it);
     if (exception_setup(true)) {
-        while (ok && e && cnt < qcnt) {
-            if (cnt < big_queue_size)
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
-            e = e->next;
+        while (ok && e && cnt < n) {
+            if (cnt < big_queue_size) {
+                /* Stored length bounds the output without a scan */
+                size_t len = e->len;
+                if (len > string_length)
+                    len = string_length;
+                report_noreturn(vlevel, cnt == 0 ? "%.*s" : " %.*s",
+                                (int) len, e->value);
+            }
+            e = q_iter_next(&it);
             cnt++;
             ok = ok && !error_check();
         }
@@ -610,13 +1263,21 @@ static bool show_queue(int vlevel)
         report(
             vlevel,
             "ERROR:  Either list has cycle, or queue has more than %d elements",
-            qcnt);
+            n);
         ok = false;
     }
 
     return ok;
 }
 
+static bool show_queue(int vlevel)
+{
+    if (verblevel < vlevel)
+        return true;
+
+    return show_elems(vlevel, queues[selected].name, q, qcnt);
+}
+
 static bool do_show(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -626,6 +1287,422 @@ static bool do_show(int argc, char *argv[])
     return show_queue(0);
 }
 
+static bool do_compile(int argc, char *argv[])
+{
+    if (argc != 3) {
+        report(1, "%s needs 2 arguments", argv[0]);
+        return false;
+    }
+    return trace_compile(argv[1], argv[2]);
+}
+
+/* Free the queue as replay of a trace does it, without further checks */
+static void replay_free()
+{
+    if (qcnt > big_queue_size)
+        set_cautious_mode(false);
+    release_queue(q);
+    set_cautious_mode(true);
+    q = NULL;
+    qcnt = 0;
+}
+
+/* Remove n elements, comparing the last one with expects if non-NULL */
+static bool replay_remove(int n, char *expects)
+{
+    char *removes = expects ? malloc(string_length + 1) : NULL;
+    if (expects && !removes) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed strings");
+        return false;
+    }
+
+    bool ok = true;
+    int cnt = q_remove_head_bulk(q, removes, string_length + 1, n);
+    qcnt -= cnt;
+    if (cnt != n) {
+        fail_count++;
+        if (expects || fail_count >= fail_limit) {
+            report(1, "ERROR: Removal from queue failed (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
+    } else if (expects && strncmp(removes, expects, string_length)) {
+        report(1, "ERROR: Removed value %s != expected value %s", removes,
+               expects);
+        ok = false;
+    }
+
+    free(removes);
+    return ok;
+}
+
+/* Run one operation of a compiled trace.  Return false on error */
+static bool replay_op(const trace_prog_t *prog, const trace_op_t *t)
+{
+    char *s = t->str < prog->nstrs ? prog->strs[t->str] : NULL;
+    switch (t->op) {
+    case TOP_NEW:
+        if (q)
+            replay_free();
+        q = q_new_flags(queue_flags());
+        return true;
+    case TOP_FREE:
+        replay_free();
+        if (!others_allocated() && !q_reclaim_pending() &&
+            allocation_check() > 0) {
+            report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
+                   allocation_check());
+            return false;
+        }
+        return true;
+    case TOP_IH:
+    case TOP_IT:
+        return insert_reps(t->op == TOP_IT, s, t->str == TRACE_RAND, t->arg) >=
+               0;
+    case TOP_RH:
+        return replay_remove(t->arg, s);
+    case TOP_RHQ:
+        return replay_remove(t->arg, NULL);
+    case TOP_REVERSE:
+        q_reverse(q);
+        return true;
+    case TOP_SORT:
+        q_sort(q);
+        return true;
+    case TOP_SIZE:
+        for (int r = 0; r < t->arg; r++) {
+            int cnt = q_size(q);
+            if (cnt != (int) qcnt) {
+                report(1,
+                       "ERROR: Computed queue size as %d, but correct value "
+                       "is %d",
+                       cnt, (int) qcnt);
+                return false;
+            }
+        }
+        return true;
+    case TOP_OPTION:
+        if (!set_option(s, t->arg)) {
+            report(1, "Unknown parameter '%s'", s);
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool do_replay(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    trace_prog_t *prog = trace_load(argv[1]);
+    if (!prog)
+        return false;
+    error_check();
+
+    /* Operations run straight against the queue, so only errors are shown */
+    double time;
+    init_time(&time);
+    uint32_t i = 0;
+    bool ok = true;
+    if (exception_setup(false)) {
+        for (; ok && i < prog->nops; i++)
+            ok = replay_op(prog, &prog->ops[i]) && !error_check();
+    }
+    exception_cancel();
+
+    if (!ok)
+        report(1, "ERROR: Replay stopped at operation %u of %u", i,
+               prog->nops);
+    report(1, "Replayed %u operations in %.3f seconds", i, delta_time(&time));
+    trace_release(prog);
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* Operations timed by the bench command */
+typedef enum {
+    BENCH_IH,
+    BENCH_IT,
+    BENCH_RH,
+    BENCH_REVERSE,
+    BENCH_SORT,
+    BENCH_SIZE,
+    BENCH_FREE,
+    BENCH_IS,
+    BENCH_ITSORT, /* Insert at tail, then sort the whole queue */
+    BENCH_NOPS,
+} bench_op_t;
+
+static char *bench_names[BENCH_NOPS] = {
+    "ih", "it", "rh", "reverse", "sort", "size", "free", "is", "itsort"};
+
+/* Operations inserting one string into the queue */
+#define BENCH_INSERTS(op) \
+    ((op) == BENCH_IH || (op) == BENCH_IT || (op) == BENCH_IS || \
+     (op) == BENCH_ITSORT)
+
+/* Default length of the queues built for each run of sort and free */
+#define BENCH_QUEUE_LEN 10000
+
+/* Marks bench results of the release build, see the qbench target */
+#ifdef QBENCH
+#define BUILD_TAG "qbench+"
+#else
+#define BUILD_TAG ""
+#endif
+
+/* Describe the layout options that new queues get */
+static void layout_name(char *buf, size_t size)
+{
+    snprintf(buf, size, "%s%s%s%s%s%s%s%s", BUILD_TAG,
+             coalloc ? "coalloc+" : "", pool ? "pool+" : "",
+             sso ? "sso+" : "", unrolled ? "unrolled+" : "",
+             dlist ? "dlist+" : "", intern ? "intern+" : "",
+             deferred ? "deferred+" : "");
+    size_t len = strlen(buf);
+    snprintf(buf + len, size - len, "threads=%d", q_sort_threads);
+}
+
+/* Build a queue of len random strings for sort and free to work on */
+static queue_t *bench_queue(int len)
+{
+    static char rand_bufs[RAND_BATCH][MAX_RANDSTR_LEN];
+    char *sv[RAND_BATCH];
+    queue_t *bq = q_new_flags(queue_flags());
+    for (int done = 0; bq && done < len;) {
+        int n = len - done < RAND_BATCH ? len - done : RAND_BATCH;
+        fill_rand_strings(rand_bufs, sv, n);
+        if (q_insert_tail_bulk(bq, sv, n, n) != n) {
+            q_free(bq);
+            return NULL;
+        }
+        done += n;
+    }
+    return bq;
+}
+
+/*
+ * Run operation op once, storing the cycles it took in *tick.
+ * Return false if the operation failed.
+ */
+static bool bench_step(bench_op_t op, char *arg, int len, char *removes,
+                       int64_t *tick)
+{
+    static char randstr_buf[1][MAX_RANDSTR_LEN];
+    queue_t *bq = NULL;
+    bool ok = true;
+    int64_t start;
+
+    if (!strcmp(arg, "RAND") && BENCH_INSERTS(op)) {
+        fill_rand_strings(randstr_buf, NULL, 1);
+        arg = randstr_buf[0];
+    }
+    if (op == BENCH_SORT || op == BENCH_FREE) {
+        bq = bench_queue(len);
+        if (!bq)
+            return false;
+    }
+
+    start = cpucycles_start();
+    switch (op) {
+    case BENCH_IH:
+        ok = q_insert_head(q, arg);
+        break;
+    case BENCH_IT:
+        ok = q_insert_tail(q, arg);
+        break;
+    case BENCH_RH:
+        ok = q_remove_head(q, removes, string_length + 1);
+        break;
+    case BENCH_REVERSE:
+        q_reverse(q);
+        break;
+    case BENCH_SORT:
+        q_sort(bq);
+        break;
+    case BENCH_SIZE:
+        ok = q_size(q) == (int) qcnt;
+        break;
+    case BENCH_FREE:
+        release_queue(bq);
+        bq = NULL;
+        break;
+    case BENCH_IS:
+        ok = q_insert_sorted(q, arg);
+        break;
+    case BENCH_ITSORT:
+        ok = q_insert_tail(q, arg);
+        q_sort(q);
+        break;
+    default:
+        break;
+    }
+    *tick = cpucycles_end() - start;
+
+    if (ok && BENCH_INSERTS(op))
+        qcnt++;
+    else if (ok && op == BENCH_RH)
+        qcnt--;
+    q_free(bq);
+    return ok;
+}
+
+static bool do_bench(int argc, char *argv[])
+{
+    char *file = NULL;
+    bench_format_t fmt = BENCH_CSV;
+    if (argc >= 5 && (!strcmp(argv[argc - 2], "csv") ||
+                      !strcmp(argv[argc - 2], "json"))) {
+        fmt = strcmp(argv[argc - 2], "csv") ? BENCH_JSON : BENCH_CSV;
+        file = argv[argc - 1];
+        argc -= 2;
+    }
+    if (argc != 3 && argc != 4) {
+        report(1, "%s needs 2-5 arguments", argv[0]);
+        return false;
+    }
+
+    int op = 0;
+    while (op < BENCH_NOPS && strcmp(argv[1], bench_names[op]))
+        op++;
+    if (op == BENCH_NOPS) {
+        report(1, "Unknown operation '%s'", argv[1]);
+        return false;
+    }
+
+    int n;
+    if (!get_int(argv[2], &n) || n <= 0) {
+        report(1, "Invalid number of operations '%s'", argv[2]);
+        return false;
+    }
+
+    char *arg = argc == 4 ? argv[3] : "dolphin";
+    int len = BENCH_QUEUE_LEN;
+    if ((op == BENCH_SORT || op == BENCH_FREE) && argc == 4 &&
+        (!get_int(argv[3], &len) || len < 0)) {
+        report(1, "Invalid queue length '%s'", argv[3]);
+        return false;
+    }
+    if (!q && op != BENCH_SORT && op != BENCH_FREE) {
+        report(1, "No queue to run %s on", argv[1]);
+        return false;
+    }
+
+    int64_t *ticks = malloc(n * sizeof(int64_t));
+    char *removes = malloc(string_length + 1);
+    if (!ticks || !removes) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for bench");
+        free(ticks);
+        free(removes);
+        return false;
+    }
+    error_check();
+
+    size_t done = 0;
+    bool ok = true;
+    double seconds = bench_wall_time();
+    int64_t cycles = cpucycles();
+    if (exception_setup(false)) {
+        while (ok && done < (size_t) n) {
+            ok = bench_step(op, arg, len, removes, &ticks[done]) &&
+                 !error_check();
+            done += ok;
+        }
+    }
+    exception_cancel();
+    cycles = cpucycles() - cycles;
+    seconds = bench_wall_time() - seconds;
+
+    if (!ok)
+        report(1, "ERROR: %s failed after %zu operations", argv[1], done);
+
+    char layout[64];
+    layout_name(layout, sizeof(layout));
+    bench_result_t r = {.op = argv[1], .layout = layout};
+    bench_summarize(&r, ticks, done, seconds, cycles);
+    bench_report(&r);
+    if (file && !bench_write(&r, file, fmt)) {
+        report(1, "Could not write bench results to '%s'", file);
+        ok = false;
+    }
+
+    free(ticks);
+    free(removes);
+    return ok;
+}
+
+static char *stress_names[] = {"mpmc", "spsc", "mutex"};
+
+static bool do_stress(int argc, char *argv[])
+{
+    if (argc != 5) {
+        report(1, "%s needs 4 arguments", argv[0]);
+        return false;
+    }
+
+    int kind = 0;
+    while (kind <= STRESS_MUTEX && strcmp(argv[1], stress_names[kind]))
+        kind++;
+    if (kind > STRESS_MUTEX) {
+        report(1, "Unknown queue kind '%s'", argv[1]);
+        return false;
+    }
+
+    int producers, consumers, n;
+    if (!get_int(argv[2], &producers) || !get_int(argv[3], &consumers) ||
+        producers < 1 || consumers < 1 ||
+        producers + consumers > CQ_MAX_THREADS) {
+        report(1, "Invalid numbers of threads '%s' and '%s' (at most %d)",
+               argv[2], argv[3], CQ_MAX_THREADS);
+        return false;
+    }
+    if (kind == STRESS_SPSC && (producers != 1 || consumers != 1)) {
+        report(1, "spsc queues take one producer and one consumer");
+        return false;
+    }
+    if (!get_int(argv[4], &n) || n <= 0) {
+        report(1, "Invalid number of strings '%s'", argv[4]);
+        return false;
+    }
+    error_check();
+
+    size_t blocks = allocation_check();
+    stress_result_t r;
+    bool set_up = false;
+    set_threaded_mode(true);
+    if (exception_setup(true))
+        set_up = stress_run(kind, producers, consumers, n, &r);
+    exception_cancel();
+    set_threaded_mode(false);
+    if (!set_up) {
+        /* The harness has already reported a run that ran out of time */
+        if (!error_check())
+            report(1, "ERROR: Could not set up stress run");
+        return false;
+    }
+    report(1, "%s, %d producers, %d consumers: %ld strings in %.3f s, %.0f ops/s",
+           argv[1], producers, consumers, (long) producers * n, r.seconds,
+           r.ops_per_sec);
+
+    bool ok = true;
+    if (r.errors) {
+        report(1, "ERROR: %ld strings lost, repeated or out of order",
+               r.errors);
+        ok = false;
+    }
+    if (allocation_check() != blocks) {
+        report(1, "ERROR: Stress run left %zu blocks allocated",
+               allocation_check() - blocks);
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
 /* Signal handlers */
 static void sigsegvhandler(int sig)
 {
@@ -647,6 +1724,8 @@ static void queue_init()
 {
     fail_count = 0;
     q = NULL;
+    selected = find_queue("q", true);
+    set_alloc_owner(selected);
     signal(SIGSEGV, sigsegvhandler);
     signal(SIGALRM, sigalrmhandler);
 }
@@ -658,7 +1737,19 @@ static bool queue_quit(int argc, char *argv[])
         set_cautious_mode(false);
 
     if (exception_setup(true))
-        q_free(q);
+        release_queue(q);
+    exception_cancel();
+    for (size_t i = 0; i < nqueues; i++) {
+        if (i != selected)
+            free_entry(&queues[i]);
+        free(queues[i].name);
+    }
+    free(queues);
+
+    /* Wait for deferred frees, which the check must not count as leaks */
+    set_cautious_mode(false);
+    if (exception_setup(false))
+        q_reclaim();
     exception_cancel();
     set_cautious_mode(true);
 
@@ -744,7 +1835,7 @@ int main(int argc, char *argv[])
             break;
         case 'l':
             strncpy(lbuf, optarg, BUFSIZE);
-            buf[BUFSIZE - 1] = '\0';
+            lbuf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
         default:
@@ -754,7 +1845,8 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
+    seed = random_entropy() & INT_MAX;
+    random_seed(seed);
     queue_init();
     init_cmd();
     console_init();
@@ -1,15 +1,53 @@
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "harness.h"
+#include "intern.h"
 #include "queue.h"
+#include "random.h"
+
+/* Queues given to q_free_deferred() that still hold elements */
+static queue_t *reclaim_list = NULL;
+
+static void reclaim_slice();
+
+static void skip_free(queue_t *q);
+static void skip_pop(queue_t *q, list_ele_t *e);
+
+/* Mark the index of q_insert_sorted() out of date after other changes */
+static inline void skip_invalidate(queue_t *q)
+{
+    if (q->skip) {
+        q->skip_stale = true;
+    }
+}
+
+/* Free a few of the elements waiting since q_free_deferred(), if any */
+static inline void reclaim_some()
+{
+    if (reclaim_list) {
+        reclaim_slice();
+    }
+}
 
 /*
  * Create empty queue.
  * Return NULL if could not allocate space.
  */
 queue_t *q_new()
+{
+    return q_new_flags(0);
+}
+
+/*
+ * Create empty queue with the layout selected by flags.  A Q_POOL queue
+ * shares pool, or gets a pool of its own if pool is NULL.
+ * Return NULL if could not allocate space.
+ */
+static queue_t *new_queue(unsigned int flags, pool_t *pool)
 {
     queue_t *q = malloc(sizeof(queue_t));
     if (!q) {
@@ -18,23 +56,443 @@ queue_t *q_new()
     q->head = NULL;
     q->tail = NULL;
     q->size = 0;
+    q->flags = flags;
+    q->pool = NULL;
+    q->chead = NULL;
+    q->ctail = NULL;
+    q->spare = NULL;
+    q->reclaim_next = NULL;
+    q->skip = NULL;
+    q->skip_stale = false;
+    if (flags & Q_UNROLLED) {
+        q->flags &= ~Q_DLIST;
+    }
+    if (flags & Q_POOL) {
+        q->pool = pool ? pool_share(pool) : pool_new();
+        if (!q->pool) {
+            free(q);
+            return NULL;
+        }
+    }
     return q;
 }
 
+/*
+ * Create empty queue whose elements use the layout selected by flags.
+ * Return NULL if could not allocate space.
+ */
+queue_t *q_new_flags(unsigned int flags)
+{
+    reclaim_some();
+    return new_queue(flags, NULL);
+}
+
+/* Bytes taken by an element holding a string of s_length bytes inline */
+#define INLINE_SIZE(s_length) (sizeof(list_ele_t) + sizeof(char) * (s_length))
+
+/* Size of the elements of queue q that store strings of s_length bytes */
+static size_t element_size(queue_t *q, size_t s_length)
+{
+    if (q->flags & Q_INTERN) {
+        return sizeof(list_ele_t);
+    }
+    if (q->flags & Q_SSO) {
+        return Q_SSO_SIZE;
+    }
+    if (q->flags & (Q_COALLOC | Q_POOL)) {
+        return INLINE_SIZE(s_length);
+    }
+    return sizeof(list_ele_t);
+}
+
+/* Allocate storage for elements and strings of queue q */
+static void *q_alloc(queue_t *q, size_t size)
+{
+    return q->pool ? pool_alloc(q->pool, size) : malloc(size);
+}
+
+/* Give back storage obtained from q_alloc() */
+static void q_release(queue_t *q, void *p, size_t size)
+{
+    if (q->pool) {
+        pool_release(q->pool, p, size);
+    } else {
+        free(p);
+    }
+}
+
+/*
+ * Free the storage of an element already unlinked from queue q.
+ * A string living in data[] goes away together with the element.
+ */
+static void release_element(queue_t *q, list_ele_t *e)
+{
+    if (q->flags & Q_INTERN) {
+        intern_put(e->value);
+    } else if (e->value != e->data) {
+        q_release(q, e->value, e->len + 1);
+    }
+    q_release(q, e, element_size(q, e->len + 1));
+}
+
+/*
+ * Copy the string of e to sp, truncated to bufsize-1 characters.
+ * No effect if sp is NULL or bufsize is 0.
+ */
+static void copy_value(const list_ele_t *e, char *sp, size_t bufsize)
+{
+    if (!sp || !bufsize) {
+        return;
+    }
+
+    size_t v_length = e->len;
+    if (v_length > bufsize - 1) {
+        v_length = bufsize - 1;
+    }
+    memcpy(sp, e->value, sizeof(char) * v_length);
+    sp[v_length] = '\0';
+}
+
+/*
+ * Doubly linked backend.  The next field of each element holds the XOR of
+ * the addresses of its neighbours, NULL counting as zero, so the list reads
+ * the same from either end and reversing it swaps q->head and q->tail.
+ */
+#define XOR_LINK(a, b) ((list_ele_t *) ((uintptr_t) (a) ^ (uintptr_t) (b)))
+
+/* Return the element after cur, reached from prev, in a linked queue */
+static inline list_ele_t *next_element(queue_t *q,
+                                       list_ele_t *prev,
+                                       list_ele_t *cur)
+{
+    return (q->flags & Q_DLIST) ? XOR_LINK(prev, cur->next) : cur->next;
+}
+
+/*
+ * Link b after a, where a ends a list and b, unless NULL, starts one.
+ * Called again on the same pair, it cuts them apart.
+ */
+static void toggle_link(queue_t *q, list_ele_t *a, list_ele_t *b)
+{
+    a->next = XOR_LINK(a->next, b);
+    if ((q->flags & Q_DLIST) && b) {
+        b->next = XOR_LINK(b->next, a);
+    }
+}
+
+/* Turn the links of a Q_DLIST queue into plain next pointers */
+static void dlist_unzip(queue_t *q)
+{
+    list_ele_t *prev = NULL;
+    for (list_ele_t *e = q->head; e;) {
+        list_ele_t *next = XOR_LINK(prev, e->next);
+        e->next = next;
+        prev = e;
+        e = next;
+    }
+}
+
+/* Turn plain next pointers from q->head back into Q_DLIST links */
+static void dlist_zip(queue_t *q)
+{
+    list_ele_t *prev = NULL;
+    for (list_ele_t *e = q->head; e;) {
+        list_ele_t *next = e->next;
+        e->next = XOR_LINK(prev, next);
+        prev = e;
+        e = next;
+    }
+}
+
+/*
+ * Unrolled backend.  The elements are reached through the slots of a
+ * singly-linked list of chunks rather than through their next pointers,
+ * while q->head and q->tail still point at the first and last element.
+ */
+
+/* Get an empty chunk for q, reusing the spare one if there is one */
+static chunk_t *chunk_new(queue_t *q)
+{
+    chunk_t *c = q->spare;
+    if (c) {
+        q->spare = NULL;
+    } else {
+        c = q_alloc(q, sizeof(chunk_t));
+        if (!c) {
+            return NULL;
+        }
+    }
+    c->next = NULL;
+    return c;
+}
+
+/* Retire a chunk that became empty, keeping one of them for reuse */
+static void chunk_release(queue_t *q, chunk_t *c)
+{
+    if (!q->spare) {
+        q->spare = c;
+    } else {
+        q_release(q, c, sizeof(chunk_t));
+    }
+}
+
+/* Store e in front of the first slot.  Return false if out of memory */
+static bool chunk_push_head(queue_t *q, list_ele_t *e)
+{
+    chunk_t *c = q->chead;
+    if (!c || !c->head) {
+        c = chunk_new(q);
+        if (!c) {
+            return false;
+        }
+        c->head = c->tail = Q_CHUNK_LEN;
+        c->next = q->chead;
+        q->chead = c;
+        if (!q->ctail) {
+            q->ctail = c;
+        }
+    }
+    c->slots[--c->head] = e;
+    return true;
+}
+
+/* Store e after the last slot.  Return false if out of memory */
+static bool chunk_push_tail(queue_t *q, list_ele_t *e)
+{
+    chunk_t *c = q->ctail;
+    if (!c || c->tail == Q_CHUNK_LEN) {
+        c = chunk_new(q);
+        if (!c) {
+            return false;
+        }
+        c->head = c->tail = 0;
+        if (q->ctail) {
+            q->ctail->next = c;
+        } else {
+            q->chead = c;
+        }
+        q->ctail = c;
+    }
+    c->slots[c->tail++] = e;
+    return true;
+}
+
+/*
+ * Drop the first slot of a non-empty queue.
+ * Return the element that is now first, NULL if the queue became empty.
+ */
+static list_ele_t *chunk_pop_head(queue_t *q)
+{
+    chunk_t *c = q->chead;
+    if (++c->head == c->tail) {
+        q->chead = c->next;
+        if (!q->chead) {
+            q->ctail = NULL;
+        }
+        chunk_release(q, c);
+        c = q->chead;
+        if (!c) {
+            return NULL;
+        }
+    }
+    return c->slots[c->head];
+}
+
+/*
+ * Drop the last slot of a non-empty queue.  Chunks only link forward, so
+ * emptying the last one takes a walk to the chunk before it.
+ * Return the element that is now last, NULL if the queue became empty.
+ */
+static list_ele_t *chunk_pop_tail(queue_t *q)
+{
+    chunk_t *c = q->ctail;
+    if (--c->tail == c->head) {
+        chunk_t *prev = NULL;
+        for (chunk_t *p = q->chead; p != c; p = p->next) {
+            prev = p;
+        }
+        if (prev) {
+            prev->next = NULL;
+        } else {
+            q->chead = NULL;
+        }
+        q->ctail = prev;
+        chunk_release(q, c);
+        c = prev;
+        if (!c) {
+            return NULL;
+        }
+    }
+    return c->slots[c->tail - 1];
+}
+
+/* Reverse the order of the chunks and of the slots inside each of them */
+static void chunk_reverse(queue_t *q)
+{
+    chunk_t *prev = NULL, *c = q->chead;
+    q->ctail = c;
+    while (c) {
+        for (int i = c->head, j = c->tail - 1; i < j; i++, j--) {
+            list_ele_t *tmp = c->slots[i];
+            c->slots[i] = c->slots[j];
+            c->slots[j] = tmp;
+        }
+        chunk_t *next = c->next;
+        c->next = prev;
+        prev = c;
+        c = next;
+    }
+    q->chead = prev;
+}
+
+/* Chain the elements through next in queue order, starting at q->head */
+static void chunk_link(queue_t *q)
+{
+    list_ele_t *last = NULL;
+    for (chunk_t *c = q->chead; c; c = c->next) {
+        for (int i = c->head; i < c->tail; i++) {
+            if (last) {
+                last->next = c->slots[i];
+            }
+            last = c->slots[i];
+        }
+    }
+    last->next = NULL;
+}
+
+/* Put the elements chained from list back into the slots, in order */
+static void chunk_scatter(queue_t *q, list_ele_t *list)
+{
+    for (chunk_t *c = q->chead; c; c = c->next) {
+        for (int i = c->head; i < c->tail; i++) {
+            c->slots[i] = list;
+            list = list->next;
+        }
+    }
+}
+
+/*
+ * Move the chunks holding the first k < q->size elements of q to the empty
+ * queue dst, copying the slots of a chunk that has to be cut in two.
+ * Return false if out of memory.
+ */
+static bool chunk_split(queue_t *q, queue_t *dst, int k)
+{
+    chunk_t *prev = NULL, *c = q->chead;
+    while (k >= c->tail - c->head) {
+        k -= c->tail - c->head;
+        prev = c;
+        c = c->next;
+    }
+    if (k) {
+        chunk_t *part = chunk_new(dst);
+        if (!part) {
+            return false;
+        }
+        part->head = 0;
+        part->tail = k;
+        memcpy(part->slots, c->slots + c->head, sizeof(list_ele_t *) * k);
+        c->head += k;
+        if (prev) {
+            prev->next = part;
+        } else {
+            q->chead = part;
+        }
+        prev = part;
+    }
+    prev->next = NULL;
+    dst->chead = q->chead;
+    dst->ctail = prev;
+    dst->head = dst->chead->slots[dst->chead->head];
+    dst->tail = prev->slots[prev->tail - 1];
+    q->chead = c;
+    q->head = c->slots[c->head];
+    return true;
+}
+
+/*
+ * Tell whether destroying the pool of q frees all of its storage at once.
+ * Interned strings live outside the pool and still need releasing.
+ */
+static bool pool_owns_all(queue_t *q)
+{
+    return q->pool && !pool_shared(q->pool) && !(q->flags & Q_INTERN);
+}
+
+/* Free all storage used by queue q, which must not be NULL */
+static void free_queue(queue_t *q)
+{
+    /* Storage in a pool of its own goes away with the pool */
+    if (!pool_owns_all(q)) {
+        if (q->flags & Q_UNROLLED) {
+            while (q->chead) {
+                chunk_t *c = q->chead;
+                q->chead = c->next;
+                for (int i = c->head; i < c->tail; i++) {
+                    release_element(q, c->slots[i]);
+                }
+                q_release(q, c, sizeof(chunk_t));
+            }
+            if (q->spare) {
+                q_release(q, q->spare, sizeof(chunk_t));
+            }
+        } else {
+            list_ele_t *prev = NULL;
+            while (q->head) {
+                list_ele_t *target = q->head;
+                q->head = next_element(q, prev, target);
+                release_element(q, target);
+                prev = target;
+            }
+        }
+    }
+    skip_free(q);
+    pool_destroy(q->pool);
+    free(q);
+}
+
 /* Free all storage used by queue */
 void q_free(queue_t *q)
 {
+    reclaim_some();
+    if (q) {
+        free_queue(q);
+    }
+}
+
+/*
+ * Free all storage used by queue, deferring the release of its elements.
+ * Unless a pool of its own lets the queue go at once, it joins the list
+ * of queues emptied Q_RECLAIM_SLICE elements at a time by later calls.
+ */
+void q_free_deferred(queue_t *q)
+{
+    reclaim_some();
     if (!q) {
         return;
     }
+    if (!q->size || pool_owns_all(q)) {
+        free_queue(q);
+        return;
+    }
+    q->reclaim_next = reclaim_list;
+    reclaim_list = q;
+}
 
-    while (q->head) {
-        list_ele_t *target = q->head;
-        q->head = q->head->next;
-        free(target->value);
-        free(target);
+/* Number of leading bytes of a string cached in list_ele_t.prefix */
+#define PREFIX_LEN sizeof(uint64_t)
+
+/* Pack the first bytes of s, which takes s_length bytes, into a prefix */
+static uint64_t key_prefix(const char *s, size_t s_length)
+{
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < PREFIX_LEN; i++) {
+        prefix <<= 8;
+        if (i < s_length) {
+            prefix |= (unsigned char) s[i];
+        }
     }
-    free(q);
+    return prefix;
 }
 
 /*
@@ -42,21 +500,34 @@ void q_free(queue_t *q)
  * Return the pointer to element if successful.
  * Return NULL otherwise.
  */
-static list_ele_t *loc_element(char *s)
+static list_ele_t *loc_element(queue_t *q, char *s)
 {
-    list_ele_t *new = malloc(sizeof(list_ele_t));
+    size_t s_length = strlen(s) + 1;
+    size_t size = element_size(q, s_length);
+    list_ele_t *new = q_alloc(q, size);
     if (!new) {
         return NULL;
     }
 
-    size_t s_length = strlen(s) + 1;
-    char *val = malloc(sizeof(char) * s_length);
-    if (!val) {
-        free(new);
-        return NULL;
+    if (q->flags & Q_INTERN) {
+        new->value = (char *) intern_get(s, s_length - 1);
+        if (!new->value) {
+            q_release(q, new, size);
+            return NULL;
+        }
+    } else if (INLINE_SIZE(s_length) <= size) {
+        new->value = new->data;
+        memcpy(new->value, s, sizeof(char) * s_length);
+    } else {
+        new->value = q_alloc(q, sizeof(char) * s_length);
+        if (!new->value) {
+            q_release(q, new, size);
+            return NULL;
+        }
+        memcpy(new->value, s, sizeof(char) * s_length);
     }
-    memcpy(val, s, sizeof(char) * s_length);
-    new->value = val;
+    new->len = s_length - 1;
+    new->prefix = key_prefix(s, s_length);
     new->next = NULL;
     return new;
 }
@@ -70,19 +541,28 @@ static list_ele_t *loc_element(char *s)
  */
 bool q_insert_head(queue_t *q, char *s)
 {
+    reclaim_some();
     if (!q) {
         return false;
     }
+    skip_invalidate(q);
 
-    list_ele_t *newh = loc_element(s);
+    list_ele_t *newh = loc_element(q, s);
     if (!newh) {
         return false;
     }
 
+    if (q->flags & Q_UNROLLED) {
+        if (!chunk_push_head(q, newh)) {
+            release_element(q, newh);
+            return false;
+        }
+    } else {
+        toggle_link(q, newh, q->head);
+    }
     if (!q->size) {
         q->tail = newh;
     }
-    newh->next = q->head;
     q->head = newh;
     q->size++;
     return true;
@@ -97,19 +577,27 @@ bool q_insert_head(queue_t *q, char *s)
  */
 bool q_insert_tail(queue_t *q, char *s)
 {
+    reclaim_some();
     if (!q) {
         return false;
     }
+    skip_invalidate(q);
 
-    list_ele_t *newt = loc_element(s);
+    list_ele_t *newt = loc_element(q, s);
     if (!newt) {
         return false;
     }
 
+    if (q->flags & Q_UNROLLED) {
+        if (!chunk_push_tail(q, newt)) {
+            release_element(q, newt);
+            return false;
+        }
+    } else if (q->size) {
+        toggle_link(q, q->tail, newt);
+    }
     if (!q->size) {
         q->head = newt;
-    } else {
-        q->tail->next = newt;
     }
     q->tail = newt;
     q->size++;
@@ -124,129 +612,792 @@ bool q_insert_tail(queue_t *q, char *s)
  * (up to a maximum of bufsize-1 characters, plus a null terminator.)
  * The space used by the list element and the string should be freed.
  */
-bool q_remove_head(queue_t *q, char *sp, size_t bufsize)
+static bool remove_head(queue_t *q, char *sp, size_t bufsize)
 {
     if (!q || !q->head) {
         return false;
     }
 
     list_ele_t *target = q->head;
-    q->head = q->head->next;
+    if (q->flags & Q_UNROLLED) {
+        q->head = chunk_pop_head(q);
+    } else {
+        q->head = next_element(q, NULL, target);
+        if (q->head) {
+            toggle_link(q, target, q->head);
+        }
+    }
     q->size--;
     if (!q->size) {
         q->tail = NULL;
     }
 
-    // TODO(memcpy to sp could case buffer overflow?)
-    if (sp) {
-        size_t v_length = strlen(target->value);
-        if (v_length > bufsize) {
-            memcpy(sp, target->value, bufsize - 1);
-            sp[bufsize - 1] = '\0';
-        } else {
-            memcpy(sp, target->value, sizeof(char) * (v_length + 1));
-        }
-    }
-    free(target->value);
-    free(target);
+    copy_value(target, sp, bufsize);
+    skip_pop(q, target);
+    release_element(q, target);
 
     return true;
 }
 
-/*
- * Return number of elements in queue.
- * Return 0 if q is NULL or empty
- */
-int q_size(queue_t *q)
+bool q_remove_head(queue_t *q, char *sp, size_t bufsize)
 {
-    return !q ? 0 : q->size;
+    reclaim_some();
+    return remove_head(q, sp, bufsize);
 }
 
-/*
- * Reverse elements in queue
- * No effect if q is NULL or empty
- * This function should not allocate or free any list elements
- * (e.g., by calling q_insert_head, q_insert_tail, or q_remove_head).
- * It should rearrange the existing ones.
- */
-void q_reverse(queue_t *q)
+/* Release one slice of the elements of the first queue waiting */
+static void reclaim_slice()
 {
-    if (!q || !q->head || q->size <= 1) {
-        return;
+    queue_t *q = reclaim_list;
+    for (int i = 0; i < Q_RECLAIM_SLICE && q->head; i++) {
+        remove_head(q, NULL, 0);
     }
-
-    // reverse the linked-list
-    list_ele_t *next = q->head->next;
-    list_ele_t *cur = q->head;
-    while (next) {
-        list_ele_t *tmp = next->next;
-        next->next = cur;
-
-        cur = next;
-        next = tmp;
+    if (!q->head) {
+        reclaim_list = q->reclaim_next;
+        free_queue(q);
     }
-    q->head->next = NULL;
+}
 
-    // swap head-tail
-    list_ele_t *tmp = q->head;
-    q->head = q->tail;
-    q->tail = tmp;
+void q_reclaim()
+{
+    while (reclaim_list) {
+        reclaim_slice();
+    }
 }
 
+bool q_reclaim_pending()
+{
+    return reclaim_list != NULL;
+}
 
 /*
- * Merge two list and return the new head.
+ * Attempt to remove element from tail of queue, like q_remove_head().
+ * Only Q_DLIST queues can step back from the tail; singly-linked ones walk
+ * from the head to the element before it.
  */
-static list_ele_t *merge(list_ele_t *head1, list_ele_t *head2)
+bool q_remove_tail(queue_t *q, char *sp, size_t bufsize)
 {
-    list_ele_t *merged = NULL;
-    list_ele_t *cursor = NULL;
-    while (head1 && head2) {
-        list_ele_t **head =
-            strcmp(head1->value, head2->value) <= 0 ? &head1 : &head2;
-        if (!cursor) {
-            merged = *head;
-            cursor = *head;
-        } else {
-            cursor->next = *head;
-            cursor = cursor->next;
-        }
-        *head = (*head)->next;
+    reclaim_some();
+    if (!q || !q->head) {
+        return false;
     }
+    skip_invalidate(q);
 
-    if (head1) {
-        cursor->next = head1;
-    } else if (head2) {
-        cursor->next = head2;
+    list_ele_t *target = q->tail;
+    if (q->flags & Q_UNROLLED) {
+        q->tail = chunk_pop_tail(q);
+    } else if (q->size == 1) {
+        q->tail = NULL;
+    } else if (q->flags & Q_DLIST) {
+        q->tail = target->next;
+        toggle_link(q, q->tail, target);
+    } else {
+        list_ele_t *prev = q->head;
+        while (prev->next != target) {
+            prev = prev->next;
+        }
+        q->tail = prev;
+        toggle_link(q, prev, target);
     }
-    return merged;
+    q->size--;
+    if (!q->size) {
+        q->head = NULL;
+    }
+
+    copy_value(target, sp, bufsize);
+    release_element(q, target);
+
+    return true;
 }
 
 /*
- * Sort the linked list with known length.
+ * Attempt to insert n strings at head of queue, taking them in turn from
+ * the nstr strings of sv, with the same result as n calls of q_insert_head().
+ * The new elements are chained first and spliced onto the queue at once.
+ * Return number of strings inserted, less than n if out of memory.
  */
-static void recur_sort(list_ele_t **target, int length)
+int q_insert_head_bulk(queue_t *q, char *const sv[], int nstr, int n)
 {
-    if (length <= 1) {
-        return;
+    reclaim_some();
+    if (!q || nstr <= 0) {
+        return 0;
     }
+    skip_invalidate(q);
 
-    list_ele_t *lhead = *target, *rhead = *target;
-    int halflen = length / 2;
-    for (int i = halflen; i > 1; i--) {
-        rhead = rhead->next;
+    list_ele_t *first = NULL, *last = NULL;
+    int cnt = 0;
+    for (int i = 0; cnt < n; cnt++) {
+        list_ele_t *newh = loc_element(q, sv[i]);
+        if (!newh) {
+            break;
+        }
+        if (q->flags & Q_UNROLLED) {
+            if (!chunk_push_head(q, newh)) {
+                release_element(q, newh);
+                break;
+            }
+        } else if (first) {
+            toggle_link(q, newh, first);
+        }
+        if (!last) {
+            last = newh;
+        }
+        first = newh;
+        if (++i == nstr) {
+            i = 0;
+        }
+    }
+    if (!cnt) {
+        return 0;
     }
-    list_ele_t *tmp = rhead;
-    rhead = rhead->next;
-    tmp->next = NULL;
 
-    recur_sort(&lhead, halflen);
-    recur_sort(&rhead, length - halflen);
-    *target = merge(lhead, rhead);
+    if (!(q->flags & Q_UNROLLED)) {
+        toggle_link(q, last, q->head);
+    }
+    if (!q->size) {
+        q->tail = last;
+    }
+    q->head = first;
+    q->size += cnt;
+    return cnt;
 }
 
 /*
- * Sort elements of queue in ascending order
+ * Attempt to insert n strings at tail of queue, taking them in turn from
+ * the nstr strings of sv, with the same result as n calls of q_insert_tail().
+ * The new elements are chained first and spliced onto the queue at once.
+ * Return number of strings inserted, less than n if out of memory.
+ */
+int q_insert_tail_bulk(queue_t *q, char *const sv[], int nstr, int n)
+{
+    reclaim_some();
+    if (!q || nstr <= 0) {
+        return 0;
+    }
+    skip_invalidate(q);
+
+    list_ele_t *first = NULL, *last = NULL;
+    int cnt = 0;
+    for (int i = 0; cnt < n; cnt++) {
+        list_ele_t *newt = loc_element(q, sv[i]);
+        if (!newt) {
+            break;
+        }
+        if (q->flags & Q_UNROLLED) {
+            if (!chunk_push_tail(q, newt)) {
+                release_element(q, newt);
+                break;
+            }
+        } else if (last) {
+            toggle_link(q, last, newt);
+        }
+        if (!first) {
+            first = newt;
+        }
+        last = newt;
+        if (++i == nstr) {
+            i = 0;
+        }
+    }
+    if (!cnt) {
+        return 0;
+    }
+
+    if (!q->size) {
+        q->head = first;
+    } else if (!(q->flags & Q_UNROLLED)) {
+        toggle_link(q, q->tail, first);
+    }
+    q->tail = last;
+    q->size += cnt;
+    return cnt;
+}
+
+/*
+ * Attempt to remove up to n elements from head of queue.
+ * If sp is non-NULL, copy the string of the last removed element to *sp
+ * as q_remove_head() does.  The removed span is detached from the queue
+ * first and then freed in one pass.
+ * Return number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_head_bulk(queue_t *q, char *sp, size_t bufsize, int n)
+{
+    reclaim_some();
+    if (!q || !q->head || n <= 0) {
+        return 0;
+    }
+    if (n > q->size) {
+        n = q->size;
+    }
+
+    if (q->flags & Q_UNROLLED) {
+        for (int left = n; left;) {
+            chunk_t *c = q->chead;
+            int k = c->tail - c->head;
+            if (k > left) {
+                k = left;
+            }
+            left -= k;
+            if (!left) {
+                copy_value(c->slots[c->head + k - 1], sp, bufsize);
+            }
+            for (; k; k--) {
+                release_element(q, c->slots[c->head++]);
+            }
+            if (c->head == c->tail) {
+                q->chead = c->next;
+                chunk_release(q, c);
+            }
+        }
+        if (!q->chead) {
+            q->ctail = NULL;
+        }
+        q->head = q->chead ? q->chead->slots[q->chead->head] : NULL;
+    } else {
+        list_ele_t *span = q->head, *prev = NULL, *last = span;
+        for (int i = 1; i < n; i++) {
+            list_ele_t *next = next_element(q, prev, last);
+            prev = last;
+            last = next;
+        }
+        q->head = next_element(q, prev, last);
+        if (q->head) {
+            toggle_link(q, last, q->head);
+        }
+        copy_value(last, sp, bufsize);
+        for (prev = NULL; span;) {
+            list_ele_t *next = next_element(q, prev, span);
+            skip_pop(q, span);
+            release_element(q, span);
+            prev = span;
+            span = next;
+        }
+    }
+
+    q->size -= n;
+    if (!q->size) {
+        q->tail = NULL;
+    }
+    return n;
+}
+
+/*
+ * Return number of elements in queue.
+ * Return 0 if q is NULL or empty
+ */
+int q_size(queue_t *q)
+{
+    return !q ? 0 : q->size;
+}
+
+/*
+ * Move all elements of src to the tail of dst, leaving src empty.
+ * Only links are changed, whatever the number of elements.  Pools that
+ * differ are merged first, after which both queues share the pool.
+ * Return false if the flags of the queues differ, or if src has a pool
+ * that it shares with another queue, leaving both queues unchanged.
+ */
+bool q_concat(queue_t *dst, queue_t *src)
+{
+    if (!dst || !src || dst == src || dst->flags != src->flags) {
+        return false;
+    }
+    if (dst->pool != src->pool) {
+        if (!pool_merge(dst->pool, src->pool)) {
+            return false;
+        }
+        src->pool = pool_share(dst->pool);
+    }
+    if (!src->size) {
+        return true;
+    }
+    skip_invalidate(dst);
+    skip_invalidate(src);
+
+    if (dst->flags & Q_UNROLLED) {
+        if (dst->ctail) {
+            dst->ctail->next = src->chead;
+        } else {
+            dst->chead = src->chead;
+        }
+        dst->ctail = src->ctail;
+        src->chead = src->ctail = NULL;
+    } else if (dst->size) {
+        toggle_link(dst, dst->tail, src->head);
+    }
+    if (!dst->size) {
+        dst->head = src->head;
+    }
+    dst->tail = src->tail;
+    dst->size += src->size;
+    src->head = src->tail = NULL;
+    src->size = 0;
+    return true;
+}
+
+/*
+ * Move the first k elements of q, or all of them if q has fewer, into a
+ * new queue with the same flags, which shares the pool of q.
+ * Takes time proportional to k.
+ * Return the new queue, or NULL if q is NULL or could not allocate space.
+ */
+queue_t *q_split(queue_t *q, int k)
+{
+    if (!q) {
+        return NULL;
+    }
+    queue_t *front = new_queue(q->flags, q->pool);
+    if (!front || k <= 0) {
+        return front;
+    }
+    if (k >= q->size) {
+        q_concat(front, q);
+        return front;
+    }
+    skip_invalidate(q);
+
+    if (q->flags & Q_UNROLLED) {
+        if (!chunk_split(q, front, k)) {
+            q_free(front);
+            return NULL;
+        }
+    } else {
+        list_ele_t *prev = NULL, *last = q->head;
+        for (int i = 1; i < k; i++) {
+            list_ele_t *next = next_element(q, prev, last);
+            prev = last;
+            last = next;
+        }
+        list_ele_t *rest = next_element(q, prev, last);
+        toggle_link(q, last, rest);
+        front->head = q->head;
+        front->tail = last;
+        q->head = rest;
+    }
+    front->size = k;
+    q->size -= k;
+    return front;
+}
+
+bool q_compact(queue_t *q)
+{
+    /*
+     * Finish the deferred frees first, so that the inserts below neither
+     * interleave with them nor reuse the holes they leave
+     */
+    q_reclaim();
+    if (!q) {
+        return false;
+    }
+
+    /* Copy the elements in queue order into a queue of the same layout */
+    queue_t *fresh = new_queue(q->flags, NULL);
+    if (!fresh) {
+        return false;
+    }
+    q_iter_t it;
+    for (list_ele_t *e = q_iter_first(q, &it); e; e = q_iter_next(&it)) {
+        if (!q_insert_tail(fresh, e->value)) {
+            free_queue(fresh);
+            return false;
+        }
+    }
+
+    /* Swap the storage of the two queues, then free the old one */
+    queue_t old = *q;
+    *q = *fresh;
+    *fresh = old;
+    free_queue(fresh);
+    return true;
+}
+
+/*
+ * Reverse elements in queue
+ * No effect if q is NULL or empty
+ * This function should not allocate or free any list elements
+ * (e.g., by calling q_insert_head, q_insert_tail, or q_remove_head).
+ * It should rearrange the existing ones.
+ */
+void q_reverse(queue_t *q)
+{
+    if (!q || !q->head || q->size <= 1) {
+        return;
+    }
+    skip_invalidate(q);
+
+    if (q->flags & (Q_UNROLLED | Q_DLIST)) {
+        if (q->flags & Q_UNROLLED) {
+            chunk_reverse(q);
+        }
+        list_ele_t *tmp = q->head;
+        q->head = q->tail;
+        q->tail = tmp;
+        return;
+    }
+
+    // reverse the linked-list
+    list_ele_t *next = q->head->next;
+    list_ele_t *cur = q->head;
+    while (next) {
+        list_ele_t *tmp = next->next;
+        next->next = cur;
+
+        cur = next;
+        next = tmp;
+    }
+    q->head->next = NULL;
+
+    // swap head-tail
+    list_ele_t *tmp = q->head;
+    q->head = q->tail;
+    q->tail = tmp;
+}
+
+
+/*
+ * Order of two elements, with the same sign convention as strcmp.
+ * Most pairs differ in their cached prefixes, so the strings themselves
+ * are only read on ties.
+ */
+static inline int cmp_element(const list_ele_t *a, const list_ele_t *b)
+{
+    if (a->prefix != b->prefix) {
+        return a->prefix < b->prefix ? -1 : 1;
+    }
+    /* Equal prefixes that include a null terminator mean equal strings */
+    size_t len = a->len < b->len ? a->len : b->len;
+    if (len < PREFIX_LEN) {
+        return 0;
+    }
+    /* Compare the rest up to and including the shorter terminator */
+    return memcmp(a->value + PREFIX_LEN, b->value + PREFIX_LEN,
+                  len + 1 - PREFIX_LEN);
+}
+
+/* A sorted, NULL-terminated stretch of the list waiting to be merged */
+typedef struct {
+    list_ele_t *head, *tail;
+    int len;
+} run_t;
+
+/*
+ * Pending runs satisfy the timsort invariants, so their lengths grow at
+ * least as fast as the Fibonacci numbers and this many levels cover any
+ * queue whose size fits in an int.
+ */
+#define MAX_PENDING 64
+
+/*
+ * Cut the longest ascending run off the front of list and store it in run.
+ * A descending run is reversed on the way, except that elements comparing
+ * equal keep their order, which keeps the sort stable.
+ * Return the rest of the list.
+ */
+static list_ele_t *take_run(list_ele_t *list, run_t *run)
+{
+    list_ele_t *rest = list->next;
+    int len = 1;
+    if (rest && cmp_element(list, rest) > 0) {
+        /* group is the last element equal to the current head */
+        list_ele_t *head = list, *group = list;
+        list->next = NULL;
+        run->tail = list;
+        int cmp;
+        while (rest && (cmp = cmp_element(head, rest)) >= 0) {
+            list_ele_t *next = rest->next;
+            if (cmp) {
+                rest->next = head;
+                head = rest;
+            } else {
+                rest->next = group->next;
+                group->next = rest;
+            }
+            group = rest;
+            rest = next;
+            len++;
+        }
+        run->head = head;
+    } else {
+        list_ele_t *last = list;
+        while (rest && cmp_element(last, rest) <= 0) {
+            last = rest;
+            rest = rest->next;
+            len++;
+        }
+        last->next = NULL;
+        run->head = list;
+        run->tail = last;
+    }
+    run->len = len;
+    return rest;
+}
+
+/*
+ * Merge run2 into run1, which must precede it in the list.
+ * Equal elements keep their order, taking run1 first.
+ */
+static void merge(run_t *run1, run_t *run2)
+{
+    list_ele_t *head1 = run1->head, *head2 = run2->head;
+    list_ele_t *merged = NULL, **indirect = &merged;
+    while (head1 && head2) {
+        list_ele_t **head = cmp_element(head1, head2) <= 0 ? &head1 : &head2;
+        *indirect = *head;
+        indirect = &(*head)->next;
+        *head = (*head)->next;
+    }
+
+    if (head1) {
+        *indirect = head1;
+    } else {
+        *indirect = head2;
+        run1->tail = run2->tail;
+    }
+    run1->head = merged;
+    run1->len += run2->len;
+}
+
+/* Merge pending[i] with pending[i + 1], shrinking the stack of n runs */
+static void merge_at(run_t *pending, int *n, int i)
+{
+    merge(&pending[i], &pending[i + 1]);
+    if (i + 2 < *n) {
+        pending[i + 1] = pending[i + 2];
+    }
+    (*n)--;
+}
+
+/*
+ * Restore the timsort invariants on the stack of n pending runs:
+ * len[i - 2] > len[i - 1] + len[i] and len[i - 1] > len[i].
+ */
+static void merge_collapse(run_t *pending, int *n)
+{
+    while (*n > 1) {
+        int i = *n - 2;
+        if ((i > 0 &&
+             pending[i - 1].len <= pending[i].len + pending[i + 1].len) ||
+            (i > 1 &&
+             pending[i - 2].len <= pending[i - 1].len + pending[i].len)) {
+            if (pending[i - 1].len < pending[i + 1].len) {
+                i--;
+            }
+        } else if (pending[i].len > pending[i + 1].len) {
+            break;
+        }
+        merge_at(pending, n, i);
+    }
+}
+
+/*
+ * Sort list with a bottom-up natural merge sort.
+ * Store the last element of the sorted list in *tail and return its head.
+ */
+static list_ele_t *sort_list(list_ele_t *list, list_ele_t **tail)
+{
+    run_t pending[MAX_PENDING];
+    int n = 0;
+    while (list) {
+        list = take_run(list, &pending[n++]);
+        merge_collapse(pending, &n);
+    }
+    while (n > 1) {
+        merge_at(pending, &n, n - 2);
+    }
+
+    *tail = pending[0].tail;
+    return pending[0].head;
+}
+
+/* Queues with at least this many elements are radix sorted */
+#define RADIX_THRESHOLD 4096
+
+/* Radix buckets with fewer elements than this are merge sorted instead */
+#define RADIX_CUTOFF 32
+
+/* Lists broken into more than one run per this many elements count as
+ * unsorted, and go to the radix sort.
+ */
+#define RUN_RATIO 64
+
+/*
+ * Tell whether list of size elements falls into few enough natural runs
+ * for the merge sort to beat the radix sort.  Only the cached prefixes are
+ * compared, and the scan stops as soon as the answer is known.
+ */
+static bool has_long_runs(const list_ele_t *list, int size)
+{
+    int limit = size / RUN_RATIO, runs = 1;
+    int dir = 0; /* 1 while ascending, -1 while descending, 0 if unknown */
+    for (const list_ele_t *e = list; e->next; e = e->next) {
+        if (e->prefix == e->next->prefix) {
+            continue;
+        }
+        int d = e->prefix < e->next->prefix ? 1 : -1;
+        if (!dir) {
+            dir = d;
+        } else if (d != dir) {
+            if (++runs > limit) {
+                return false;
+            }
+            dir = 0;
+        }
+    }
+    return true;
+}
+
+/*
+ * Sort list with an MSD radix sort on the cached prefixes, whose first
+ * depth bytes are the same for every element of list.
+ * Elements are distributed into one bucket per value of the next byte,
+ * in order, so the sort is stable.  Buckets whose strings are longer than
+ * the prefix, or that are too short to be worth another pass, are finished
+ * by the merge sort.  Recursion is bounded by the length of the prefix,
+ * so the bucket tables fit on the stack and nothing is allocated.
+ * Store the last element of the sorted list in *tail and return its head.
+ */
+static list_ele_t *radix_sort(list_ele_t *list, size_t depth,
+                              list_ele_t **tail)
+{
+    list_ele_t *heads[256], *tails[256];
+    int counts[256];
+    memset(counts, 0, sizeof(counts));
+
+    int shift = 8 * (PREFIX_LEN - 1 - depth);
+    while (list) {
+        int b = (list->prefix >> shift) & 0xff;
+        if (!counts[b]) {
+            heads[b] = list;
+        } else {
+            tails[b]->next = list;
+        }
+        tails[b] = list;
+        counts[b]++;
+        list = list->next;
+    }
+
+    list_ele_t *sorted = NULL, **indirect = &sorted;
+    for (int b = 0; b < 256; b++) {
+        if (!counts[b]) {
+            continue;
+        }
+        list_ele_t *bhead = heads[b], *btail = tails[b];
+        btail->next = NULL;
+        /* In bucket 0 every string has ended, so they are all equal */
+        if (b && counts[b] > 1) {
+            if (depth + 1 == PREFIX_LEN || counts[b] < RADIX_CUTOFF) {
+                bhead = sort_list(bhead, &btail);
+            } else {
+                bhead = radix_sort(bhead, depth + 1, &btail);
+            }
+        }
+        *indirect = bhead;
+        indirect = &btail->next;
+        *tail = btail;
+    }
+    return sorted;
+}
+
+/* Sort list of size elements with the better suited sequential engine */
+static list_ele_t *sort_chain(list_ele_t *list, int size, list_ele_t **tail)
+{
+    if (size >= RADIX_THRESHOLD && !has_long_runs(list, size)) {
+        return radix_sort(list, 0, tail);
+    }
+    return sort_list(list, tail);
+}
+
+/* Number of threads q_sort may use */
+int q_sort_threads = 1;
+
+/* Upper bound on q_sort_threads */
+#define MAX_SORT_THREADS 64
+
+/* Threads are only worth starting for at least this many elements each */
+#define PARALLEL_MIN_CHUNK 16384
+
+/* Two adjacent runs for a merge thread, src following dst in the list */
+typedef struct {
+    run_t *dst, *src;
+} merge_job_t;
+
+static void *sort_worker(void *arg)
+{
+    run_t *run = arg;
+    run->head = sort_chain(run->head, run->len, &run->tail);
+    return NULL;
+}
+
+static void *merge_worker(void *arg)
+{
+    merge_job_t *job = arg;
+    merge(job->dst, job->src);
+    return NULL;
+}
+
+/*
+ * Call fn on each of n jobs laid out size bytes apart, one thread per job,
+ * and wait for all of them.  The calling thread does the first job itself,
+ * as well as any job whose thread could not be started.
+ */
+static void run_parallel(void *(*fn)(void *), void *jobs, size_t size, int n)
+{
+    pthread_t tids[MAX_SORT_THREADS];
+    bool started[MAX_SORT_THREADS];
+    for (int i = 1; i < n; i++) {
+        started[i] =
+            !pthread_create(&tids[i], NULL, fn, (char *) jobs + i * size);
+    }
+
+    fn(jobs);
+    for (int i = 1; i < n; i++) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        } else {
+            fn((char *) jobs + i * size);
+        }
+    }
+}
+
+/*
+ * Cut queue q into one sublist per thread, sort them all at the same time,
+ * then merge neighbouring sublists pairwise as a tree.
+ * Only stack space is used, so this is fine in noallocate mode.
+ */
+static void parallel_sort(queue_t *q, int threads)
+{
+    run_t runs[MAX_SORT_THREADS];
+    list_ele_t *list = q->head;
+    for (int i = 0; i < threads; i++) {
+        int len = q->size / threads + (i < q->size % threads);
+        runs[i].head = list;
+        runs[i].len = len;
+        for (int j = 1; j < len; j++) {
+            list = list->next;
+        }
+        list_ele_t *last = list;
+        list = list->next;
+        last->next = NULL;
+    }
+    run_parallel(sort_worker, runs, sizeof(run_t), threads);
+
+    merge_job_t jobs[MAX_SORT_THREADS / 2];
+    for (int width = 1; width < threads; width *= 2) {
+        int n = 0;
+        for (int i = 0; i + width < threads; i += 2 * width) {
+            jobs[n].dst = &runs[i];
+            jobs[n].src = &runs[i + width];
+            n++;
+        }
+        run_parallel(merge_worker, jobs, sizeof(merge_job_t), n);
+    }
+
+    q->head = runs[0].head;
+    q->tail = runs[0].tail;
+}
+
+/*
+ * Sort elements of queue in ascending order
  * No effect if q is NULL or empty. In addition, if q has only one
  * element, do nothing.
  */
@@ -255,11 +1406,393 @@ void q_sort(queue_t *q)
     if (!q || !q->size || q->size == 1) {
         return;
     }
+    skip_invalidate(q);
+
+    int threads = q_sort_threads;
+    if (threads > MAX_SORT_THREADS) {
+        threads = MAX_SORT_THREADS;
+    }
+    if (threads > q->size / PARALLEL_MIN_CHUNK) {
+        threads = q->size / PARALLEL_MIN_CHUNK;
+    }
+
+    /* Other backends are sorted as a singly-linked list and then restored */
+    if (q->flags & Q_UNROLLED) {
+        chunk_link(q);
+    } else if (q->flags & Q_DLIST) {
+        dlist_unzip(q);
+    }
+
+    /*
+     * SIGALRM stays blocked until the queue is whole again, and the helper
+     * threads inherit that mask.  A time limit set by the test harness that
+     * runs out meanwhile fires once every thread is joined.
+     */
+    sigset_t alrm, old;
+    if (threads > 1) {
+        sigemptyset(&alrm);
+        sigaddset(&alrm, SIGALRM);
+        pthread_sigmask(SIG_BLOCK, &alrm, &old);
+        parallel_sort(q, threads);
+    } else {
+        q->head = sort_chain(q->head, q->size, &q->tail);
+    }
+
+    if (q->flags & Q_UNROLLED) {
+        chunk_scatter(q, q->head);
+    } else if (q->flags & Q_DLIST) {
+        dlist_zip(q);
+    }
+    if (threads > 1) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+}
+
+/*
+ * Skip-list index of q_insert_sorted().  The elements themselves form the
+ * bottom level; a node of the index stands for one element on each of its
+ * levels, with a quarter of the nodes of a level reaching the next one.
+ * A search descends to the last indexed element not above the new string
+ * and walks the few elements left from there.
+ */
+#define SKIP_MAX_LEVEL 16
+
+struct SKIP {
+    list_ele_t *ele;  /* Indexed element, NULL in the head of the index */
+    list_ele_t *prev; /* Element before it, to walk Q_DLIST links from ele */
+    int levels;
+    struct SKIP *next[];
+};
+
+static skip_t *skip_node(list_ele_t *ele, list_ele_t *prev, int levels)
+{
+    skip_t *n = malloc(sizeof(skip_t) + levels * sizeof(skip_t *));
+    if (!n) {
+        return NULL;
+    }
+    n->ele = ele;
+    n->prev = prev;
+    n->levels = levels;
+    for (int l = 0; l < levels; l++) {
+        n->next[l] = NULL;
+    }
+    return n;
+}
+
+static void skip_free(queue_t *q)
+{
+    if (!q->skip) {
+        return;
+    }
+    skip_t *n = q->skip;
+    while (n) {
+        skip_t *next = n->next[0];
+        free(n);
+        n = next;
+    }
+    q->skip = NULL;
+    q->skip_stale = false;
+}
+
+/*
+ * Index the elements of a sorted queue in one pass, giving every fourth
+ * of them a node, every sixteenth a node of two levels, and so on.
+ * Return false, with no index, if out of memory.
+ */
+static bool skip_build(queue_t *q)
+{
+    skip_free(q);
+    skip_t *head = skip_node(NULL, NULL, SKIP_MAX_LEVEL);
+    if (!head) {
+        return false;
+    }
+    head->levels = 1;
+    q->skip = head;
+
+    skip_t *last[SKIP_MAX_LEVEL];
+    for (int l = 0; l < SKIP_MAX_LEVEL; l++) {
+        last[l] = head;
+    }
+    list_ele_t *prev = NULL, *e = q->head;
+    for (unsigned long i = 1; e; i++) {
+        int levels = 0;
+        for (unsigned long j = i; !(j & 3) && levels < SKIP_MAX_LEVEL - 1;
+             j >>= 2) {
+            levels++;
+        }
+        if (levels) {
+            skip_t *n = skip_node(e, prev, levels);
+            if (!n) {
+                skip_free(q);
+                return false;
+            }
+            for (int l = 0; l < levels; l++) {
+                last[l]->next[l] = n;
+                last[l] = n;
+            }
+            if (levels > head->levels) {
+                head->levels = levels;
+            }
+        }
+        list_ele_t *next = next_element(q, prev, e);
+        prev = e;
+        e = next;
+    }
+    return true;
+}
 
-    recur_sort(&q->head, q->size);
-    list_ele_t *ele = q->head;
-    for (int l = q->size; l > 1; l--) {
-        ele = ele->next;
+/* Number of levels of the node of a new element, 0 for none */
+static int skip_random_levels()
+{
+    /* Drawn from the seeded generator, so that option seed fixes the index */
+    int levels = 0;
+    for (uint64_t r = random_u64(); !(r & 3) && levels < SKIP_MAX_LEVEL - 1;
+         r >>= 2) {
+        levels++;
+    }
+    return levels;
+}
+
+/* Drop e, about to be removed from the head of q, from a current index */
+static void skip_pop(queue_t *q, list_ele_t *e)
+{
+    if (!q->skip || q->skip_stale) {
+        return;
+    }
+    skip_t *head = q->skip, *n = head->next[0];
+    if (n && n->ele == e) {
+        for (int l = 0; l < n->levels; l++) {
+            head->next[l] = n->next[l];
+        }
+        free(n);
+        n = head->next[0];
+    }
+    if (n && n->prev == e) {
+        n->prev = NULL;
+    }
+}
+
+/*
+ * Move the adjacent elements *prev and *next of a sorted linked queue
+ * forward until e belongs between them.
+ */
+static void walk_sorted(queue_t *q,
+                        list_ele_t *e,
+                        list_ele_t **prev,
+                        list_ele_t **next)
+{
+    while (*next && cmp_element(*next, e) <= 0) {
+        list_ele_t *after = next_element(q, *prev, *next);
+        *prev = *next;
+        *next = after;
+    }
+}
+
+/* Link e between the adjacent elements prev and next, either may be NULL */
+static void link_between(queue_t *q,
+                         list_ele_t *prev,
+                         list_ele_t *e,
+                         list_ele_t *next)
+{
+    if (prev) {
+        toggle_link(q, prev, next);
+        toggle_link(q, prev, e);
+    } else {
+        q->head = e;
+    }
+    if (next) {
+        toggle_link(q, e, next);
+    } else {
+        q->tail = e;
+    }
+}
+
+/* Insert e into a sorted linked queue with a current index */
+static void skip_insert(queue_t *q, list_ele_t *e)
+{
+    skip_t *head = q->skip, *x = head;
+    skip_t *update[SKIP_MAX_LEVEL];
+    for (int l = SKIP_MAX_LEVEL - 1; l >= 0; l--) {
+        if (l < head->levels) {
+            while (x->next[l] && cmp_element(x->next[l]->ele, e) <= 0) {
+                x = x->next[l];
+            }
+        }
+        update[l] = x;
+    }
+
+    /* The walk stops before the next indexed element, which is above e */
+    list_ele_t *prev = x->ele;
+    list_ele_t *next = prev ? next_element(q, x->prev, prev) : q->head;
+    walk_sorted(q, e, &prev, &next);
+    link_between(q, prev, e, next);
+    skip_t *bound = x->next[0];
+    if (bound && bound->ele == next) {
+        bound->prev = e;
+    }
+
+    /* Without memory for a node, e is just left out of the index */
+    int levels = skip_random_levels();
+    skip_t *n = levels ? skip_node(e, prev, levels) : NULL;
+    if (n) {
+        for (int l = 0; l < levels; l++) {
+            n->next[l] = update[l]->next[l];
+            update[l]->next[l] = n;
+        }
+        if (levels > head->levels) {
+            head->levels = levels;
+        }
+    }
+}
+
+/*
+ * Find the slot of the first element of an unrolled queue above e.
+ * Return its chunk, or NULL if e goes after every element.
+ */
+static chunk_t *chunk_find(queue_t *q, list_ele_t *e, int *slot)
+{
+    chunk_t *c = q->chead;
+    while (c && cmp_element(c->slots[c->tail - 1], e) <= 0) {
+        c = c->next;
+    }
+    if (!c) {
+        return NULL;
+    }
+
+    int lo = c->head, hi = c->tail - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cmp_element(c->slots[mid], e) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *slot = lo;
+    return c;
+}
+
+/*
+ * Store e in front of the given slot of chunk c, splitting c in two if it
+ * is full.  Return false if out of memory.
+ */
+static bool chunk_insert(queue_t *q, chunk_t *c, int slot, list_ele_t *e)
+{
+    if (c->head == 0 && c->tail == Q_CHUNK_LEN) {
+        chunk_t *d = chunk_new(q);
+        if (!d) {
+            return false;
+        }
+        int half = Q_CHUNK_LEN / 2;
+        memcpy(d->slots, c->slots + half,
+               (Q_CHUNK_LEN - half) * sizeof(list_ele_t *));
+        d->head = 0;
+        d->tail = Q_CHUNK_LEN - half;
+        c->tail = half;
+        d->next = c->next;
+        c->next = d;
+        if (q->ctail == c) {
+            q->ctail = d;
+        }
+        if (slot > half) {
+            c = d;
+            slot -= half;
+        }
+    }
+
+    if (c->tail < Q_CHUNK_LEN) {
+        memmove(c->slots + slot + 1, c->slots + slot,
+                (c->tail - slot) * sizeof(list_ele_t *));
+        c->tail++;
+    } else {
+        memmove(c->slots + c->head - 1, c->slots + c->head,
+                (slot - c->head) * sizeof(list_ele_t *));
+        c->head--;
+        slot--;
+    }
+    c->slots[slot] = e;
+    return true;
+}
+
+bool q_insert_sorted(queue_t *q, char *s)
+{
+    reclaim_some();
+    if (!q) {
+        return false;
+    }
+
+    list_ele_t *e = loc_element(q, s);
+    if (!e) {
+        return false;
+    }
+
+    if (q->flags & Q_UNROLLED) {
+        int slot;
+        chunk_t *c = chunk_find(q, e, &slot);
+        if (!(c ? chunk_insert(q, c, slot, e) : chunk_push_tail(q, e))) {
+            release_element(q, e);
+            return false;
+        }
+        q->head = q->chead->slots[q->chead->head];
+        q->tail = q->ctail->slots[q->ctail->tail - 1];
+    } else {
+        if (!q->skip || q->skip_stale) {
+            skip_build(q);
+        }
+        if (q->skip) {
+            skip_insert(q, e);
+        } else {
+            /* Without memory for the index, walk from the head */
+            list_ele_t *prev = NULL, *next = q->head;
+            walk_sorted(q, e, &prev, &next);
+            link_between(q, prev, e, next);
+        }
+    }
+    q->size++;
+    return true;
+}
+
+/*
+ * Start walking queue q from its head.
+ * Return the first element, or NULL if q is NULL or empty.
+ */
+list_ele_t *q_iter_first(queue_t *q, q_iter_t *it)
+{
+    it->ele = q ? q->head : NULL;
+    it->chunk = NULL;
+    it->slot = 0;
+    it->prev = NULL;
+    it->dlist = q && (q->flags & Q_DLIST);
+    if (it->ele && (q->flags & Q_UNROLLED)) {
+        it->chunk = q->chead;
+        it->slot = q->chead->head;
+    }
+    return it->ele;
+}
+
+/*
+ * Advance to the next element of the queue.
+ * Return it, or NULL once past the tail.
+ */
+list_ele_t *q_iter_next(q_iter_t *it)
+{
+    if (!it->ele) {
+        return NULL;
+    }
+
+    if (it->dlist) {
+        list_ele_t *next = XOR_LINK(it->prev, it->ele->next);
+        it->prev = it->ele;
+        it->ele = next;
+    } else if (!it->chunk) {
+        it->ele = it->ele->next;
+    } else if (++it->slot < it->chunk->tail) {
+        it->ele = it->chunk->slots[it->slot];
+    } else if ((it->chunk = it->chunk->next)) {
+        it->slot = it->chunk->head;
+        it->ele = it->chunk->slots[it->slot];
+    } else {
+        it->ele = NULL;
     }
-    q->tail = ele;
+    return it->ele;
 }
@@ -5,30 +5,113 @@
  * This program implements a queue supporting both FIFO and LIFO
  * operations.
  *
- * It uses a singly-linked list to represent the set of queue elements
+ * It uses a singly-linked list to represent the set of queue elements,
+ * or one of the backends selected by the flags below.
  */
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
 
 /* Data structure declarations */
 
-/* Linked list element (You shouldn't need to change this) */
+/* Linked list element */
 typedef struct ELE {
     /* Pointer to array holding string.
-     * This array needs to be explicitly allocated and freed
+     * This array is either explicitly allocated and freed, points into
+     * data[] when the string is co-allocated with the element, or is the
+     * interned copy shared by the elements of a Q_INTERN queue.
      */
     char *value;
+    /* Next element, or in Q_DLIST queues the XOR of the addresses of the
+     * previous and the next element.
+     */
     struct ELE *next;
+    /* First bytes of value packed big-endian and zero padded, so comparing
+     * two prefixes as integers orders them like strcmp() does.
+     */
+    uint64_t prefix;
+    size_t len; /* Length of value, not counting the null terminator */
+    /* Inline string storage, only present in co-allocated elements */
+    char data[];
 } list_ele_t;
 
+/*
+ * Layout flags, fixed when the queue is created by q_new_flags().
+ * Q_COALLOC: store each string inline after its element header, so that
+ * every element takes a single allocation.
+ * Q_POOL: carve elements and strings out of slabs owned by the queue, and
+ * reuse removed ones for later inserts.  Freeing the queue drops whole slabs.
+ * Unless Q_SSO is set as well, elements are co-allocated.
+ * Q_SSO: give every element the same size, Q_SSO_SIZE bytes, keeping strings
+ * that fit inline and allocating longer ones separately.  Takes precedence
+ * over Q_COALLOC.
+ */
+#define Q_COALLOC 0x1
+#define Q_POOL 0x2
+#define Q_SSO 0x4
+
+/* Size of every element of a Q_SSO queue, inline string included */
+#define Q_SSO_SIZE 48
+
+/*
+ * Backend flag, also fixed by q_new_flags().
+ * Q_UNROLLED: keep pointers to the elements in a list of chunks holding
+ * Q_CHUNK_LEN of them each, instead of linking the elements through next.
+ */
+#define Q_UNROLLED 0x8
+
+#define Q_CHUNK_LEN 30
+
+/*
+ * Backend flag, also fixed by q_new_flags().
+ * Q_DLIST: link the elements both ways, so that q_reverse() and
+ * q_remove_tail() take constant time.  Ignored together with Q_UNROLLED.
+ */
+#define Q_DLIST 0x10
+
+/*
+ * Q_INTERN: keep strings in the table of intern.h, so that elements holding
+ * equal strings share one immutable copy, freed with the last of them.
+ * Takes precedence over the inline storage of Q_COALLOC and Q_SSO.
+ */
+#define Q_INTERN 0x20
+
+/* Chunk of an unrolled queue, using the slots [head, tail) */
+typedef struct CHUNK {
+    struct CHUNK *next;
+    int head, tail;
+    list_ele_t *slots[Q_CHUNK_LEN];
+} chunk_t;
+
 /* Queue structure */
-typedef struct {
-    list_ele_t *head; /* Linked list of elements */
+typedef struct QUEUE {
+    list_ele_t *head; /* Linked list of elements, or first element */
     list_ele_t *tail; /* Last element of linked list */
     int size;
+    unsigned int flags; /* Layout flags given to q_new_flags() */
+    pool_t *pool;       /* Element allocator, NULL unless Q_POOL is set */
+    chunk_t *chead;     /* First and last chunk of a Q_UNROLLED queue */
+    chunk_t *ctail;
+    chunk_t *spare; /* Emptied chunk kept for reuse */
+    struct QUEUE *reclaim_next; /* Next queue waiting in q_free_deferred() */
+    struct SKIP *skip; /* Index of q_insert_sorted(), NULL if none */
+    bool skip_stale;   /* Set once the index no longer matches the list */
 } queue_t;
 
+typedef struct SKIP skip_t;
+
+/* Position in a queue while walking it from head to tail */
+typedef struct {
+    list_ele_t *ele; /* Element at this position, NULL past the tail */
+    chunk_t *chunk;  /* Chunk and slot of ele in Q_UNROLLED queues */
+    int slot;
+    list_ele_t *prev; /* Element before ele in Q_DLIST queues */
+    bool dlist;
+} q_iter_t;
+
 /* Operations on queue */
 
 /*
@@ -37,12 +120,35 @@ typedef struct {
  */
 queue_t *q_new();
 
+/*
+ * Create empty queue whose elements use the layout selected by flags.
+ * Return NULL if could not allocate space.
+ */
+queue_t *q_new_flags(unsigned int flags);
+
 /*
  * Free ALL storage used by queue.
  * No effect if q is NULL
  */
 void q_free(queue_t *q);
 
+/*
+ * Free ALL storage used by queue like q_free(), but in constant time.
+ * The elements are detached and freed Q_RECLAIM_SLICE at a time by later
+ * calls of q_new_flags(), q_free(), q_free_deferred() and the insert and
+ * remove functions, on any queue.
+ * No effect if q is NULL
+ */
+void q_free_deferred(queue_t *q);
+
+#define Q_RECLAIM_SLICE 64
+
+/* Free at once every element still waiting since q_free_deferred() */
+void q_reclaim();
+
+/* Tell whether elements are still waiting since q_free_deferred() */
+bool q_reclaim_pending();
+
 /*
  * Attempt to insert element at head of queue.
  * Return true if successful.
@@ -61,6 +167,18 @@ bool q_insert_head(queue_t *q, char *s);
  */
 bool q_insert_tail(queue_t *q, char *s);
 
+/*
+ * Attempt to insert a copy of s into a queue sorted in ascending order,
+ * after any equal strings, so that it stays sorted.
+ * Linked queues keep a skip-list index over their elements, which makes
+ * the insertion take O(log n) expected time.  Any other change to the
+ * queue, such as q_sort() or q_reverse(), leaves the index out of date, and
+ * the next insertion rebuilds it in one pass.  Q_UNROLLED queues search
+ * their chunks instead.
+ * Return false if q is NULL or could not allocate space.
+ */
+bool q_insert_sorted(queue_t *q, char *s);
+
 /*
  * Attempt to remove element from head of queue.
  * Return true if successful.
@@ -71,12 +189,75 @@ bool q_insert_tail(queue_t *q, char *s);
  */
 bool q_remove_head(queue_t *q, char *sp, size_t bufsize);
 
+/*
+ * Attempt to remove element from tail of queue, like q_remove_head().
+ * Takes constant time in Q_DLIST queues only.
+ */
+bool q_remove_tail(queue_t *q, char *sp, size_t bufsize);
+
+/*
+ * Attempt to insert n strings at head of queue, taking them in turn from
+ * the nstr strings of sv (nstr == 1 inserts n copies of sv[0]).
+ * Same result as n calls of q_insert_head(), but the new elements
+ * are spliced onto the queue in one step.
+ * Return number of strings inserted, less than n if out of memory.
+ */
+int q_insert_head_bulk(queue_t *q, char *const sv[], int nstr, int n);
+
+/*
+ * Attempt to insert n strings at tail of queue, taking them in turn from
+ * the nstr strings of sv (nstr == 1 inserts n copies of sv[0]).
+ * Same result as n calls of q_insert_tail(), but the new elements
+ * are spliced onto the queue in one step.
+ * Return number of strings inserted, less than n if out of memory.
+ */
+int q_insert_tail_bulk(queue_t *q, char *const sv[], int nstr, int n);
+
+/*
+ * Attempt to remove up to n elements from head of queue.
+ * If sp is non-NULL, the string of the last removed element is copied
+ * to *sp as in q_remove_head().
+ * Return number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_head_bulk(queue_t *q, char *sp, size_t bufsize, int n);
+
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
  */
 int q_size(queue_t *q);
 
+/*
+ * Move all elements of src to the tail of dst in constant time, leaving
+ * src empty.  No element is allocated or freed.  Q_POOL queues with pools
+ * of their own merge them first, in time proportional to the number of
+ * slabs, and from then on share one pool.
+ * Return false if the queues were created with different flags, or if
+ * src shares its pool with a queue other than dst.
+ */
+bool q_concat(queue_t *dst, queue_t *src);
+
+/*
+ * Move the first k elements of q, or all of them if q has fewer, into a
+ * new queue with the same flags, which shares the pool of q.
+ * Return the new queue, or NULL if q is NULL or could not allocate space.
+ */
+queue_t *q_split(queue_t *q, int k);
+
+/*
+ * Move the elements of queue, with the strings stored apart from them, into
+ * fresh storage allocated in queue order.  Interned strings stay shared.
+ * A Q_POOL queue gets new slabs in a pool of its own, where the elements
+ * then lie in address order, so that walking the queue goes through memory
+ * sequentially.  Other layouts allocate each element from malloc, which
+ * tends towards that order but does not promise it.  Frees deferred by
+ * q_free_deferred() are finished first.  While it runs, the queue takes
+ * twice its usual memory.
+ * Return false, leaving the queue as it was, if q is NULL or could not
+ * allocate space.
+ */
+bool q_compact(queue_t *q);
+
 /*
  * Reverse elements in queue
  * No effect if q is NULL or empty
@@ -90,7 +271,23 @@ void q_reverse(queue_t *q);
  * Sort elements of queue in ascending order
  * No effect if q is NULL or empty. In addition, if q has only one
  * element, do nothing.
+ * Large queues are sorted by up to q_sort_threads threads at once.
  */
 void q_sort(queue_t *q);
 
+/* Number of threads q_sort may use (1 or less: sort sequentially) */
+extern int q_sort_threads;
+
+/*
+ * Start walking queue q from its head.
+ * Return the first element, or NULL if q is NULL or empty.
+ */
+list_ele_t *q_iter_first(queue_t *q, q_iter_t *it);
+
+/*
+ * Advance to the next element of the queue.
+ * Return it, or NULL once past the tail.
+ */
+list_ele_t *q_iter_next(q_iter_t *it);
+
 #endif /* LAB0_QUEUE_H */
@@ -1,11 +1,21 @@
 #include "random.h"
 #include <assert.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
+/* Generator state, seeded on first use unless random_seed() came first */
+static uint64_t state[4];
+static bool seeded = false;
+
+/* Random bits not yet handed out by randombit() */
+static uint64_t bit_pool;
+static int bit_count = 0;
+
 /* shameless stolen from ebacs */
-void randombytes(uint8_t *x, size_t how_much)
+static void kernel_bytes(uint8_t *x, size_t how_much)
 {
     ssize_t i;
     static int fd = -1;
@@ -38,9 +48,85 @@ void randombytes(uint8_t *x, size_t how_much)
     }
 }
 
+/* Step of splitmix64, used to spread a seed over the whole state */
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+void random_seed(uint64_t seed)
+{
+    for (int i = 0; i < 4; i++)
+        state[i] = splitmix64(&seed);
+    bit_count = 0;
+    seeded = true;
+}
+
+uint64_t random_entropy(void)
+{
+    uint64_t seed;
+    kernel_bytes((uint8_t *) &seed, sizeof(seed));
+    return seed;
+}
+
+uint64_t random_u64(void)
+{
+    if (!seeded)
+        random_seed(random_entropy());
+
+    uint64_t result = rotl(state[1] * 5, 7) * 9;
+    uint64_t t = state[1] << 17;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotl(state[3], 45);
+    return result;
+}
+
+uint32_t random_below(uint32_t bound)
+{
+    /* Lemire's multiply-shift, rejecting the few biased products */
+    uint64_t m = (uint64_t) (uint32_t) random_u64() * bound;
+    if ((uint32_t) m < bound) {
+        uint32_t threshold = -bound % bound;
+        while ((uint32_t) m < threshold)
+            m = (uint64_t) (uint32_t) random_u64() * bound;
+    }
+    return m >> 32;
+}
+
+void randombytes(uint8_t *x, size_t how_much)
+{
+    while (how_much >= sizeof(uint64_t)) {
+        uint64_t r = random_u64();
+        memcpy(x, &r, sizeof(r));
+        x += sizeof(r);
+        how_much -= sizeof(r);
+    }
+    if (how_much) {
+        uint64_t r = random_u64();
+        memcpy(x, &r, how_much);
+    }
+}
+
 uint8_t randombit(void)
 {
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return (ret & 1);
+    if (!bit_count) {
+        bit_pool = random_u64();
+        bit_count = 64;
+    }
+    uint8_t ret = bit_pool & 1;
+    bit_pool >>= 1;
+    bit_count--;
+    return ret;
 }
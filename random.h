@@ -3,6 +3,25 @@
 
 #include <stddef.h>
 #include <stdint.h>
+
+/*
+ * Fast pseudo-random numbers from a xoshiro256** generator.
+ * It is seeded from the kernel once, or explicitly with random_seed() so
+ * that runs can be reproduced.
+ */
+
+/* Seed the generator.  The same seed always gives the same sequence */
+void random_seed(uint64_t seed);
+
+/* Read a seed from the kernel entropy source */
+uint64_t random_entropy(void);
+
+/* Next 64 random bits */
+uint64_t random_u64(void);
+
+/* Uniformly distributed value in [0, bound), bound must not be 0 */
+uint32_t random_below(uint32_t bound);
+
 void randombytes(uint8_t *x, size_t xlen);
 uint8_t randombit(void);
 
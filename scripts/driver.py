@@ -35,7 +35,24 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-coalloc",
+        19: "trace-19-pool",
+        20: "trace-20-parallel",
+        21: "trace-21-sso",
+        22: "trace-22-unrolled",
+        23: "trace-23-replay",
+        24: "trace-24-bench",
+        25: "trace-25-complexity-ops",
+        26: "trace-26-perf",
+        27: "trace-27-dlist",
+        28: "trace-28-splice",
+        29: "trace-29-queues",
+        30: "trace-30-stress",
+        31: "trace-31-deferred",
+        32: "trace-32-intern",
+        33: "trace-33-sorted",
+        34: "trace-34-compact"
     }
 
     traceProbs = {
@@ -55,10 +72,28 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25",
+        26: "Trace-26",
+        27: "Trace-27",
+        28: "Trace-28",
+        29: "Trace-29",
+        30: "Trace-30",
+        31: "Trace-31",
+        32: "Trace-32",
+        33: "Trace-33",
+        34: "Trace-34"
     }
 
-    maxScores = [0, 6, 6, 6, 6, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    maxScores = [0, 6, 6, 6, 6, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 6, 6, 6,
+                 6, 6, 6, 6, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
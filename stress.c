@@ -0,0 +1,256 @@
+/* Producers and consumers hammering a queue for the stress command */
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench.h"
+#include "cqueue.h"
+#include "queue.h"
+#include "stress.h"
+
+/* Room for a producer number and a sequence number */
+#define STRESS_STRLEN 32
+
+/* State shared by all threads of a run */
+typedef struct {
+    stress_impl_t impl;
+    cqueue_t *cq;
+    queue_t *q;
+    pthread_mutex_t lock; /* Guards q */
+    int producers, n;
+    long total;         /* Strings to move */
+    atomic_long taken;  /* Strings removed so far */
+    atomic_bool go;     /* Set once every thread is started */
+    atomic_bool abort;  /* Set if some thread could not be started */
+    atomic_bool stop;   /* Set once the time limit runs out */
+} shared_t;
+
+/* One thread, with what a consumer saw of each producer */
+typedef struct {
+    shared_t *sh;
+    int id;
+    long *last;  /* Last sequence number taken from each producer */
+    long *count; /* Strings taken from each producer */
+    long *sum;   /* Sum of their sequence numbers */
+    long errors;
+} worker_t;
+
+static bool put(shared_t *sh, char *s)
+{
+    if (sh->impl != STRESS_MUTEX) {
+        return cq_enqueue(sh->cq, s);
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    bool ok = q_insert_tail(sh->q, s);
+    pthread_mutex_unlock(&sh->lock);
+    return ok;
+}
+
+static bool get(shared_t *sh, char *buf, size_t size)
+{
+    if (sh->impl != STRESS_MUTEX) {
+        return cq_dequeue(sh->cq, buf, size);
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    bool ok = q_remove_head(sh->q, buf, size);
+    pthread_mutex_unlock(&sh->lock);
+    return ok;
+}
+
+/* Wait for the start of the run.  Return false if it is called off */
+static bool wait_start(shared_t *sh)
+{
+    while (!atomic_load(&sh->go)) {
+        sched_yield();
+    }
+    return !atomic_load(&sh->abort);
+}
+
+static void *producer(void *arg)
+{
+    worker_t *w = arg;
+    shared_t *sh = w->sh;
+    if (!wait_start(sh)) {
+        return NULL;
+    }
+
+    char buf[STRESS_STRLEN];
+    for (long seq = 0; seq < sh->n && !atomic_load(&sh->stop); seq++) {
+        snprintf(buf, sizeof(buf), "%d %ld", w->id, seq);
+        /* A full ring or a failed allocation only delays the insertion */
+        while (!put(sh, buf)) {
+            if (atomic_load(&sh->stop)) {
+                return NULL;
+            }
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    worker_t *w = arg;
+    shared_t *sh = w->sh;
+    if (!wait_start(sh)) {
+        return NULL;
+    }
+
+    char buf[STRESS_STRLEN];
+    while (atomic_load(&sh->taken) < sh->total && !atomic_load(&sh->stop)) {
+        if (!get(sh, buf, sizeof(buf))) {
+            sched_yield();
+            continue;
+        }
+        atomic_fetch_add(&sh->taken, 1);
+
+        char *end;
+        long p = strtol(buf, &end, 10);
+        long seq = strtol(end, NULL, 10);
+        if (p < 0 || p >= sh->producers || seq <= w->last[p]) {
+            w->errors++;
+            continue;
+        }
+        w->last[p] = seq;
+        w->count[p]++;
+        w->sum[p] += seq;
+    }
+    return NULL;
+}
+
+/* Has the time limit run out?  Its SIGALRM is left pending while blocked */
+static bool alarm_pending()
+{
+    sigset_t pending;
+    sigpending(&pending);
+    return sigismember(&pending, SIGALRM);
+}
+
+/* Count the errors of a run from what its consumers saw */
+static long check_run(shared_t *sh, worker_t *workers, int consumers)
+{
+    long errors = 0;
+    long expect_sum = (long) sh->n * (sh->n - 1) / 2;
+    for (int p = 0; p < sh->producers; p++) {
+        long count = 0, sum = 0;
+        for (int c = 0; c < consumers; c++) {
+            count += workers[c].count[p];
+            sum += workers[c].sum[p];
+        }
+        if (count != sh->n) {
+            errors += labs(count - sh->n);
+        } else if (sum != expect_sum) {
+            errors++;
+        }
+    }
+    for (int c = 0; c < consumers; c++) {
+        errors += workers[c].errors;
+    }
+    return errors;
+}
+
+bool stress_run(stress_impl_t impl,
+                int producers,
+                int consumers,
+                int n,
+                stress_result_t *r)
+{
+    shared_t sh = {
+        .impl = impl,
+        .producers = producers,
+        .n = n,
+        .total = (long) producers * n,
+    };
+    atomic_init(&sh.taken, 0);
+    atomic_init(&sh.go, false);
+    atomic_init(&sh.abort, false);
+    atomic_init(&sh.stop, false);
+
+    /*
+     * SIGALRM stays blocked for the whole run, and the threads inherit that
+     * mask, so the time limit cannot fire inside a worker or while they are
+     * still running.  Once it runs out, the workers are stopped and joined,
+     * and the signal is delivered when the mask is restored on return.
+     */
+    sigset_t alrm, old;
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, &old);
+
+    if (impl == STRESS_MUTEX) {
+        sh.q = q_new();
+        pthread_mutex_init(&sh.lock, NULL);
+    } else {
+        sh.cq = cq_new(impl == STRESS_SPSC ? CQ_SPSC : 0);
+    }
+
+    int nthreads = producers + consumers;
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    long *tallies = calloc(3 * (size_t) consumers * producers, sizeof(long));
+    bool ok = tids && workers && tallies && (sh.q || sh.cq);
+
+    /* Consumers come first, producers after them */
+    int started = 0;
+    for (; ok && started < nthreads; started++) {
+        worker_t *w = &workers[started];
+        w->sh = &sh;
+        if (started < consumers) {
+            w->id = started;
+            w->last = tallies + 3 * (size_t) started * producers;
+            w->count = w->last + producers;
+            w->sum = w->count + producers;
+            for (int p = 0; p < producers; p++) {
+                w->last[p] = -1;
+            }
+        } else {
+            w->id = started - consumers;
+        }
+        ok = !pthread_create(&tids[started], NULL,
+                             started < consumers ? consumer : producer, w);
+        if (!ok) {
+            break;
+        }
+    }
+
+    atomic_store(&sh.abort, !ok);
+    double seconds = bench_wall_time();
+    atomic_store(&sh.go, true);
+    struct timespec poll = {.tv_sec = 0, .tv_nsec = 100000};
+    while (ok && atomic_load(&sh.taken) < sh.total) {
+        if (alarm_pending()) {
+            atomic_store(&sh.stop, true);
+            break;
+        }
+        nanosleep(&poll, NULL);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    seconds = bench_wall_time() - seconds;
+
+    if (ok) {
+        r->seconds = seconds;
+        r->ops_per_sec = seconds > 0 ? 2.0 * sh.total / seconds : 0;
+        r->errors = check_run(&sh, workers, consumers);
+    }
+
+    if (impl == STRESS_MUTEX) {
+        q_free(sh.q);
+        pthread_mutex_destroy(&sh.lock);
+    } else {
+        cq_free(sh.cq);
+    }
+    free(tids);
+    free(workers);
+    free(tallies);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return ok;
+}
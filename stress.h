@@ -0,0 +1,40 @@
+#ifndef LAB0_STRESS_H
+#define LAB0_STRESS_H
+
+/*
+ * Multithreaded workload of the qtest stress command.
+ *
+ * Producer threads insert strings naming the producer and counting up,
+ * while consumer threads remove them.  Every string must come out once,
+ * and the strings of each producer in the order they went in.
+ */
+
+#include <stdbool.h>
+
+/* Queues that the workload can run on */
+typedef enum {
+    STRESS_MPMC,  /* cqueue_t, Michael-Scott queue */
+    STRESS_SPSC,  /* cqueue_t, ring for one producer and one consumer */
+    STRESS_MUTEX, /* queue_t behind one mutex */
+} stress_impl_t;
+
+typedef struct {
+    double seconds;     /* Wall-clock time from start to the last removal */
+    double ops_per_sec; /* Insertions and removals per second */
+    long errors;        /* Strings lost, repeated or out of order */
+} stress_result_t;
+
+/*
+ * Run producers threads inserting n strings each against consumers threads
+ * removing them, on a new queue of kind impl.
+ * Return false if the queue or the threads could not be set up.
+ * SIGALRM is blocked during the run.  If it comes, the threads are stopped
+ * and it is delivered just before returning.
+ */
+bool stress_run(stress_impl_t impl,
+                int producers,
+                int consumers,
+                int n,
+                stress_result_t *r);
+
+#endif /* LAB0_STRESS_H */
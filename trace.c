@@ -0,0 +1,355 @@
+/* Compilation of text traces into replayable binary form */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "report.h"
+#include "trace.h"
+
+/* Most words on one line of a trace */
+#define TRACE_MAX_ARGS 64
+
+/* Commands that can be compiled, with the number of arguments they take */
+static const struct {
+    char *name;
+    trace_opcode_t op;
+    int min_args, max_args;
+} trace_cmds[] = {
+    {"new", TOP_NEW, 0, 0},         {"free", TOP_FREE, 0, 0},
+    {"ih", TOP_IH, 1, 2},           {"it", TOP_IT, 1, 2},
+    {"rh", TOP_RH, 0, 2},           {"rhq", TOP_RHQ, 0, 1},
+    {"reverse", TOP_REVERSE, 0, 0}, {"sort", TOP_SORT, 0, 0},
+    {"size", TOP_SIZE, 0, 1},       {"option", TOP_OPTION, 2, TRACE_MAX_ARGS},
+};
+
+/* Trace being compiled */
+typedef struct {
+    trace_op_t *ops;
+    size_t nops, ops_cap;
+    char *strbuf; /* Interned strings, NUL-terminated one after another */
+    size_t strbytes, strbuf_cap;
+    uint32_t *offsets; /* Start of each string in strbuf */
+    size_t nstrs, offsets_cap;
+    uint32_t *slots; /* Hash table of string index + 1, 0 if free */
+    size_t nslots;
+} compiler_t;
+
+/* Resize array at *p so that it holds at least need elements */
+static void grow(void *p, size_t *cap, size_t need, size_t elsize)
+{
+    if (need <= *cap)
+        return;
+
+    size_t ncap = *cap ? *cap : 64;
+    while (ncap < need)
+        ncap *= 2;
+    void *np = realloc(*(void **) p, ncap * elsize);
+    if (!np)
+        report_event(MSG_FATAL, "Couldn't allocate space for trace");
+    *(void **) p = np;
+    *cap = ncap;
+}
+
+/* FNV-1a hash of a string argument */
+static uint32_t str_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Place string index idx in the hash table */
+static void slot_place(compiler_t *c, uint32_t idx)
+{
+    size_t mask = c->nslots - 1;
+    size_t i = str_hash(c->strbuf + c->offsets[idx]) & mask;
+    while (c->slots[i])
+        i = (i + 1) & mask;
+    c->slots[i] = idx + 1;
+}
+
+/* Return index of string s, adding it to the table if new */
+static uint32_t intern(compiler_t *c, const char *s)
+{
+    size_t mask = c->nslots - 1;
+    for (size_t i = c->nslots ? str_hash(s) & mask : 0;
+         c->nslots && c->slots[i]; i = (i + 1) & mask) {
+        uint32_t idx = c->slots[i] - 1;
+        if (strcmp(c->strbuf + c->offsets[idx], s) == 0)
+            return idx;
+    }
+
+    size_t len = strlen(s) + 1;
+    grow(&c->strbuf, &c->strbuf_cap, c->strbytes + len, 1);
+    memcpy(c->strbuf + c->strbytes, s, len);
+    grow(&c->offsets, &c->offsets_cap, c->nstrs + 1, sizeof(uint32_t));
+    c->offsets[c->nstrs] = c->strbytes;
+    c->strbytes += len;
+    uint32_t idx = c->nstrs++;
+
+    /* Keep the hash table at most half full */
+    if (2 * c->nstrs > c->nslots) {
+        free(c->slots);
+        c->nslots = c->nslots ? 2 * c->nslots : 256;
+        c->slots = calloc(c->nslots, sizeof(uint32_t));
+        if (!c->slots)
+            report_event(MSG_FATAL, "Couldn't allocate space for trace");
+        for (uint32_t i = 0; i < c->nstrs; i++)
+            slot_place(c, i);
+    } else {
+        slot_place(c, idx);
+    }
+    return idx;
+}
+
+static void emit(compiler_t *c, trace_opcode_t op, uint32_t str, int arg)
+{
+    grow(&c->ops, &c->ops_cap, c->nops + 1, sizeof(trace_op_t));
+    trace_op_t *t = &c->ops[c->nops++];
+    memset(t, 0, sizeof(*t));
+    t->op = op;
+    t->str = str;
+    t->arg = arg;
+}
+
+/* Parse optional repeat count.  Return false if it is not an integer */
+static bool get_count(int argc, char *argv[], int i, int *cnt, int lineno)
+{
+    *cnt = 1;
+    if (i < argc && !get_int(argv[i], cnt)) {
+        report(1, "Line %d: invalid count '%s'", lineno, argv[i]);
+        return false;
+    }
+    return true;
+}
+
+/* Translate one line of a trace.  Return false if it cannot be compiled */
+static bool compile_line(compiler_t *c, char *line, int lineno)
+{
+    char *argv[TRACE_MAX_ARGS + 1];
+    int argc = 0;
+    char *save = NULL;
+    for (char *w = strtok_r(line, " \t\r\n\v\f", &save); w;
+         w = strtok_r(NULL, " \t\r\n\v\f", &save)) {
+        if (argc > TRACE_MAX_ARGS) {
+            report(1, "Line %d: too many arguments", lineno);
+            return false;
+        }
+        argv[argc++] = w;
+    }
+    if (!argc || !strcmp(argv[0], "#"))
+        return true;
+
+    size_t k = 0;
+    size_t ncmds = sizeof(trace_cmds) / sizeof(trace_cmds[0]);
+    while (k < ncmds && strcmp(trace_cmds[k].name, argv[0]))
+        k++;
+    if (k == ncmds) {
+        report(1, "Line %d: cannot compile command '%s'", lineno, argv[0]);
+        return false;
+    }
+    if (argc - 1 < trace_cmds[k].min_args ||
+        argc - 1 > trace_cmds[k].max_args) {
+        report(1, "Line %d: wrong number of arguments for '%s'", lineno,
+               argv[0]);
+        return false;
+    }
+
+    trace_opcode_t op = trace_cmds[k].op;
+    int cnt = 0;
+    switch (op) {
+    case TOP_OPTION:
+        if (argc % 2 == 0) {
+            report(1, "Line %d: no value given for parameter %s", lineno,
+                   argv[argc - 1]);
+            return false;
+        }
+        for (int i = 1; i < argc; i += 2) {
+            int value;
+            if (!get_int(argv[i + 1], &value)) {
+                report(1, "Line %d: cannot parse '%s' as integer", lineno,
+                       argv[i + 1]);
+                return false;
+            }
+            emit(c, op, intern(c, argv[i]), value);
+        }
+        return true;
+    case TOP_IH:
+    case TOP_IT:
+        if (!get_count(argc, argv, 2, &cnt, lineno))
+            return false;
+        emit(c, op, strcmp(argv[1], "RAND") ? intern(c, argv[1]) : TRACE_RAND,
+             cnt);
+        return true;
+    case TOP_RH:
+        if (!get_count(argc, argv, 2, &cnt, lineno))
+            return false;
+        emit(c, op, argc > 1 ? intern(c, argv[1]) : TRACE_NOSTR, cnt);
+        return true;
+    case TOP_RHQ:
+    case TOP_SIZE:
+        if (!get_count(argc, argv, 1, &cnt, lineno))
+            return false;
+        emit(c, op, TRACE_NOSTR, cnt);
+        return true;
+    default:
+        emit(c, op, TRACE_NOSTR, 0);
+        return true;
+    }
+}
+
+/* Write the compiled trace to file dst */
+static bool write_trace(compiler_t *c, char *dst)
+{
+    /* Pad the strings so that the operations are aligned */
+    grow(&c->strbuf, &c->strbuf_cap, c->strbytes + 4, 1);
+    while (c->strbytes % 4)
+        c->strbuf[c->strbytes++] = '\0';
+
+    trace_header_t h = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .nstrs = c->nstrs,
+        .strbytes = c->strbytes,
+        .nops = c->nops,
+    };
+
+    FILE *out = fopen(dst, "wb");
+    if (!out) {
+        report(1, "Could not create compiled trace '%s'", dst);
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, out) == 1 &&
+              fwrite(c->strbuf, 1, c->strbytes, out) == c->strbytes &&
+              fwrite(c->ops, sizeof(trace_op_t), c->nops, out) == c->nops;
+    ok = fclose(out) == 0 && ok;
+    if (!ok)
+        report(1, "Could not write compiled trace '%s'", dst);
+    return ok;
+}
+
+bool trace_compile(char *src, char *dst)
+{
+    FILE *in = fopen(src, "r");
+    if (!in) {
+        report(1, "Could not open trace '%s'", src);
+        return false;
+    }
+
+    compiler_t c;
+    memset(&c, 0, sizeof(c));
+    char *line = NULL;
+    size_t line_cap = 0;
+    int lineno = 0;
+    bool ok = true;
+    while (ok && getline(&line, &line_cap, in) != -1)
+        ok = compile_line(&c, line, ++lineno);
+    free(line);
+    fclose(in);
+
+    if (ok) {
+        ok = write_trace(&c, dst);
+        if (ok)
+            report(2, "Compiled %zu operations and %zu strings into '%s'",
+                   c.nops, c.nstrs, dst);
+    }
+
+    free(c.ops);
+    free(c.strbuf);
+    free(c.offsets);
+    free(c.slots);
+    return ok;
+}
+
+/* Check that the image of a loaded trace is consistent */
+static bool trace_valid(trace_prog_t *prog, trace_header_t *h)
+{
+    if (prog->image_size < sizeof(*h) || h->magic != TRACE_MAGIC ||
+        h->version != TRACE_VERSION || h->strbytes % 4 ||
+        prog->image_size != sizeof(*h) + (size_t) h->strbytes +
+                                (size_t) h->nops * sizeof(trace_op_t))
+        return false;
+
+    prog->nstrs = h->nstrs;
+    prog->nops = h->nops;
+    prog->ops = (trace_op_t *) (prog->image + sizeof(*h) + h->strbytes);
+    if (h->nstrs > h->strbytes)
+        return false;
+    prog->strs = calloc(h->nstrs ? h->nstrs : 1, sizeof(char *));
+    if (!prog->strs)
+        return false;
+
+    /* Every string must be terminated inside the string area */
+    char *s = prog->image + sizeof(*h);
+    char *end = s + h->strbytes;
+    for (uint32_t i = 0; i < h->nstrs; i++) {
+        char *nul = memchr(s, '\0', end - s);
+        if (!nul)
+            return false;
+        prog->strs[i] = s;
+        s = nul + 1;
+    }
+
+    for (uint32_t i = 0; i < h->nops; i++) {
+        trace_op_t *t = &prog->ops[i];
+        if (t->op > TOP_OPTION)
+            return false;
+        if (t->str >= h->nstrs && t->str != TRACE_NOSTR &&
+            !(t->str == TRACE_RAND && (t->op == TOP_IH || t->op == TOP_IT)))
+            return false;
+        if (t->op == TOP_OPTION && t->str >= h->nstrs)
+            return false;
+    }
+    return true;
+}
+
+trace_prog_t *trace_load(char *file)
+{
+    FILE *in = fopen(file, "rb");
+    if (!in) {
+        report(1, "Could not open compiled trace '%s'", file);
+        return NULL;
+    }
+
+    trace_prog_t *prog = calloc(1, sizeof(trace_prog_t));
+    long size = -1;
+    if (prog && fseek(in, 0, SEEK_END) == 0)
+        size = ftell(in);
+    if (size >= 0 && fseek(in, 0, SEEK_SET) == 0) {
+        prog->image_size = size;
+        prog->image = malloc(size ? size : 1);
+    }
+    bool ok = prog && prog->image &&
+              fread(prog->image, 1, size, in) == (size_t) size;
+    fclose(in);
+
+    trace_header_t h;
+    if (ok && (size_t) size >= sizeof(h)) {
+        memcpy(&h, prog->image, sizeof(h));
+        ok = trace_valid(prog, &h);
+    } else {
+        ok = false;
+    }
+
+    if (!ok) {
+        report(1, "'%s' is not a valid compiled trace", file);
+        trace_release(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+void trace_release(trace_prog_t *prog)
+{
+    if (!prog)
+        return;
+
+    free(prog->strs);
+    free(prog->image);
+    free(prog);
+}
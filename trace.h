@@ -0,0 +1,82 @@
+#ifndef LAB0_TRACE_H
+#define LAB0_TRACE_H
+
+/*
+ * Compiled traces.
+ *
+ * A text trace of queue commands is translated into a compact binary
+ * form: a table of interned string arguments followed by fixed-size
+ * operations carrying a command ID, a string index and a pre-parsed
+ * integer.  Replaying it skips line reading, parsing and command lookup.
+ *
+ * File layout, in host byte order:
+ *   trace_header_t, then strbytes bytes of NUL-terminated strings padded
+ *   to a multiple of 4, then nops trace_op_t records.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x43525451 /* "QTRC" */
+#define TRACE_VERSION 1
+
+/* Commands a trace may be compiled from */
+typedef enum {
+    TOP_NEW,
+    TOP_FREE,
+    TOP_IH,
+    TOP_IT,
+    TOP_RH,
+    TOP_RHQ,
+    TOP_REVERSE,
+    TOP_SORT,
+    TOP_SIZE,
+    TOP_OPTION,
+} trace_opcode_t;
+
+/* Special values of trace_op_t.str */
+#define TRACE_NOSTR UINT32_MAX       /* Operation has no string argument */
+#define TRACE_RAND (UINT32_MAX - 1) /* Random strings, from "RAND" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nstrs;
+    uint32_t strbytes;
+    uint32_t nops;
+} trace_header_t;
+
+typedef struct {
+    uint8_t op; /* trace_opcode_t */
+    uint8_t pad[3];
+    uint32_t str; /* String index: argument, expected value or option name */
+    int32_t arg;  /* Repeat count, or value of an option */
+} trace_op_t;
+
+/* Compiled trace loaded in memory */
+typedef struct {
+    uint32_t nstrs;
+    uint32_t nops;
+    char **strs;
+    trace_op_t *ops;
+    char *image; /* File contents that strs and ops point into */
+    size_t image_size;
+} trace_prog_t;
+
+/*
+ * Compile text trace src into binary file dst.
+ * Return false, after reporting the problem, if a command cannot be
+ * compiled or a file cannot be accessed.
+ */
+bool trace_compile(char *src, char *dst);
+
+/*
+ * Load a compiled trace.
+ * Return NULL, after reporting the problem, if file is not a valid trace.
+ */
+trace_prog_t *trace_load(char *file);
+
+/* Free a loaded trace.  No effect if prog is NULL */
+void trace_release(trace_prog_t *prog);
+
+#endif /* LAB0_TRACE_H */
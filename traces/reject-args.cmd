@@ -0,0 +1,3 @@
+# new and free take no arguments, in traces as on the command line
+new 5
+free
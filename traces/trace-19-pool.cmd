@@ -0,0 +1,19 @@
+# Test operations and performance with slab-allocated elements
+option fail 0
+option malloc 0
+option pool 1
+new
+ih dolphin
+ih bear
+it meerkat
+rh bear
+reverse
+rh meerkat
+rh dolphin
+ih dolphin 1000000
+it gerbil 1000000
+size 1000
+reverse
+sort
+size 1000
+free
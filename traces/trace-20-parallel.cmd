@@ -0,0 +1,21 @@
+# Test performance of sort with different numbers of threads
+option fail 0
+option malloc 0
+new
+ih RAND 500000
+option threads 1
+sort
+reverse
+sort
+option threads 2
+reverse
+sort
+ih RAND 100000
+sort
+option threads 4
+reverse
+sort
+ih RAND 100000
+sort
+option threads 1
+free
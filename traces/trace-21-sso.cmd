@@ -0,0 +1,20 @@
+# Test operations and performance with small-string-optimized elements
+option fail 0
+option malloc 0
+option sso 1
+new
+ih dolphin
+ih bear
+it meerkat
+rh bear
+reverse
+rh meerkat
+rh dolphin
+ih dolphin 1000000
+it gerbil 1000000
+it a-string-longer-than-the-inline-buffer 1000
+size 1000
+reverse
+sort
+size 1000
+free
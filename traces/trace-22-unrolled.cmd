@@ -0,0 +1,29 @@
+# Test operations and performance with the unrolled backend
+option fail 0
+option malloc 0
+option unrolled 1
+new
+ih dolphin
+ih bear
+it meerkat
+rh bear
+reverse
+rh meerkat
+rh dolphin
+it dolphin 1000
+rh dolphin 1000
+ih dolphin 1000000
+it gerbil 1000000
+reverse
+sort
+size 1000
+free
+option pool 1
+new
+it gerbil
+ih dolphin 31
+it bear 31
+reverse
+sort
+rh bear 31
+free
@@ -0,0 +1,9 @@
+# Test compiling a trace and replaying it against the queue
+compile traces/trace-15-perf.cmd /tmp/qtest.trace-15.bin
+replay /tmp/qtest.trace-15.bin
+size
+free
+# Test that compile refuses lines the interpreter refuses
+reject new 5
+reject free 5
+reject compile traces/reject-args.cmd /tmp/qtest.reject-args.bin
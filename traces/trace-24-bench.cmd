@@ -0,0 +1,12 @@
+# Test the bench command on every operation it times
+option fail 0
+option malloc 0
+new
+bench it 10000
+bench ih 10000 RAND
+bench size 10000
+bench reverse 10
+bench rh 10000
+bench sort 10 1000
+bench free 10 1000
+free
@@ -0,0 +1,17 @@
+# Test the timing of the other queue operations and of the bulk variants
+option simulation 1
+ih
+rh
+reverse
+ih 16
+it 16
+rh 16
+# Test the backends too, reverse taking constant time in dlist queues only
+option unrolled 1
+rh
+reverse
+option unrolled 0
+option dlist 1
+reverse
+option dlist 0
+option simulation 0
@@ -0,0 +1,9 @@
+# Count hardware events around timed commands, where the kernel allows it
+option perf 1
+new
+time ih dolphin 1000
+time sort
+option simulation 1
+size
+option simulation 0
+free
@@ -0,0 +1,65 @@
+# Test operations and performance with the doubly linked backend
+option fail 0
+option malloc 0
+option dlist 1
+new
+ih dolphin
+ih bear
+it meerkat
+rt meerkat
+it gerbil
+reverse
+rh gerbil
+rt bear
+rh dolphin
+ih a
+it b
+it c
+ih z
+reverse
+rh c
+rt z
+sort
+rh a
+rt b
+it dolphin 1000
+ih bear 1000
+rt dolphin 500
+reverse
+rh dolphin 500
+rt bear 1000
+ih dolphin 1000000
+it gerbil 1000000
+reverse
+reverse
+reverse
+sort
+rt gerbil
+size 1000
+free
+option pool 1
+option sso 1
+new
+it gerbil
+ih dolphin 31
+it bear 31
+reverse
+rt dolphin
+sort
+rh bear 31
+rt dolphin 31
+free
+option dlist 0
+new
+ih dolphin
+it bear
+rt bear
+rt dolphin
+free
+option unrolled 1
+new
+ih dolphin 40
+it bear 2
+rt bear 2
+rt dolphin 40
+free
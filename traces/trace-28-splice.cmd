@@ -0,0 +1,94 @@
+# Test splitting queues and concatenating them again with each backend
+option fail 0
+option malloc 0
+new
+ih c
+ih b
+ih a
+split 1 front
+rh b
+concat front
+rh c
+rt a
+size
+it a
+it b
+split 0 front
+concat front
+split 5 front
+size
+concat front
+sort
+rh a
+rh b
+free
+option dlist 1
+new
+it a 40
+it b 40
+split 40 front
+rh b 39
+concat front
+rh b
+rt a
+reverse
+rh a 39
+free
+option dlist 0
+option unrolled 1
+new
+it a 45
+it b 45
+split 45 front
+rt b
+rh b 44
+ih z
+concat front
+rh z
+rt a
+rh a 44
+ih x 1000
+split 31 front
+it y
+concat front
+rh x 969
+rh y
+rh x 31
+free
+option pool 1
+option sso 1
+new
+it a 100
+it b 100
+split 100 front
+free
+select front
+free
+select q
+new
+it a 100
+it b 100
+split 70 front
+rh a 30
+it c
+concat front
+rh b 100
+rh c
+rt a
+rh a 69
+free
+option pool 0
+option sso 0
+option unrolled 0
+option fail 30
+new
+option malloc 10
+it a 50
+split 25 front
+concat front
+free
+# Test that concat takes constant time
+option malloc 0
+option simulation 1
+concat
+option simulation 0
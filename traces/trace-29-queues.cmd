@@ -0,0 +1,48 @@
+# Test several named queues, with pools merged by concat
+option fail 0
+option malloc 0
+new
+ih a 10
+select big
+new
+it b 100000
+select small
+new
+ih c
+size
+use big
+size
+rh b 50000
+size
+select q
+rh a 10
+select small
+rt c
+free
+option pool 1
+select p1
+new
+it x 1000
+select p2
+new
+it y 2000
+rh y 1000
+select p3
+new
+it z 3
+queues
+select p1
+concat p2
+concat p3
+size
+rh x 1000
+rh y 1000
+rt z
+rh z 2
+free
+option pool 0
+select big
+free
+select q
+free
+queues
@@ -0,0 +1,10 @@
+# Test the concurrent queues with growing numbers of threads
+stress mutex 1 1 20000
+stress spsc 1 1 20000
+stress mpmc 1 1 20000
+stress mpmc 2 2 10000
+stress mpmc 4 4 5000
+stress mpmc 8 8 2500
+stress mutex 8 8 2500
+stress mpmc 6 1 5000
+stress mpmc 1 6 20000
@@ -0,0 +1,61 @@
+# Test deferred frees that finish during later operations
+option fail 0
+option malloc 0
+option deferred 1
+new
+ih dolphin 1000000
+time free
+new
+ih bear 1000
+it gerbil 1000
+rh bear 1000
+rt gerbil 1000
+free
+reclaim
+option dlist 1
+new
+it a 5000
+free
+new
+ih b 10
+reclaim
+rh b 10
+free
+option dlist 0
+option unrolled 1
+new
+it a 5000
+free
+new
+it c 100
+rh c 100
+free
+reclaim
+option unrolled 0
+option pool 1
+new
+it a 5000
+split 2000 front
+free
+new
+it b 3
+select front
+rh a 2000
+free
+select q
+rh b 3
+free
+reclaim
+option pool 0
+new
+ih x 100000
+select other
+new
+ih y 10
+select q
+free
+select other
+rh y 10
+free
+bench free 20 10000
+option deferred 0
@@ -0,0 +1,59 @@
+# Test queues sharing one interned copy of equal strings
+option fail 0
+option malloc 0
+option intern 1
+new
+ih dolphin 5
+it dolphin 5
+ih bear
+it gerbil
+size
+sort
+rh bear
+rh dolphin 10
+rt gerbil
+free
+option sso 1
+option pool 1
+new
+ih aardvark_is_longer_than_eight 100
+it b 100
+reverse
+rh b 100
+split 50 rest
+concat rest
+rh aardvark_is_longer_than_eight 100
+free
+option sso 0
+option unrolled 1
+new
+ih RAND 200
+sort
+rhq 200
+free
+option unrolled 0
+option pool 0
+option dlist 1
+new
+it x 1000
+ih y 1000
+reverse
+rt y 1000
+rh x 1000
+free
+option dlist 0
+option deferred 1
+new
+ih z 500
+free
+reclaim
+option deferred 0
+new
+option fail 40
+option malloc 10
+ih dolphin 20
+it bear 20
+option malloc 0
+option fail 0
+free
+option intern 0
@@ -0,0 +1,38 @@
+# Compare sorted inserts through the skip-list index with insert-then-sort
+option fail 0
+option malloc 0
+new
+it RAND 20000
+sort
+bench is 5000 RAND
+bench itsort 100 RAND
+time is RAND 100000
+is dolphin 10
+size
+sort
+is a
+rh a
+free
+option dlist 1
+new
+is RAND 20000
+bench is 5000 RAND
+reverse
+sort
+is m 100
+free
+option dlist 0
+option unrolled 1
+new
+is RAND 20000
+bench is 5000 RAND
+free
+option unrolled 0
+new
+option fail 200
+option malloc 10
+is RAND 300
+option malloc 0
+option fail 0
+is bear 100
+free
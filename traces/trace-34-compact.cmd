@@ -0,0 +1,85 @@
+# Test compacting queues into memory in queue order after sorting
+option fail 0
+option malloc 0
+new
+ih RAND 200000
+sort
+time reverse
+time compact
+time reverse
+free
+option compact 1
+new
+ih RAND 1000
+it dolphin 10
+sort
+is bear 10
+rhq
+rhq
+free
+option coalloc 1
+new
+ih RAND 1000
+sort
+free
+option coalloc 0
+option sso 1
+option pool 1
+new
+ih short 100
+ih a_string_too_long_to_fit_inline 100
+sort
+split 50 front
+compact
+select front
+compact
+concat q
+select q
+free
+select front
+rh a_string_too_long_to_fit_inline 1
+select q
+option sso 0
+option pool 0
+option unrolled 1
+new
+ih RAND 1000
+sort
+reverse
+compact
+rhq 1000
+free
+option unrolled 0
+option dlist 1
+option intern 1
+new
+ih gerbil 500
+it RAND 500
+sort
+rhq
+free
+option intern 0
+option dlist 0
+option compact 0
+# Deferred frees still pending are finished before compacting
+option deferred 1
+new
+ih RAND 50000
+free
+new
+ih RAND 300
+sort
+compact
+free
+option deferred 0
+new
+ih RAND 300
+option fail 100
+option malloc 10
+compact
+compact
+compact
+option malloc 0
+option fail 0
+compact
+free